@@ -1,4 +1,6 @@
+#include <stddef.h>
 #include <stdint.h>
+#include "grid.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,7 +21,24 @@ struct ASTNode {
     NTOperatorDiv,
     NTOperatorAssign,
     NTOperatorMin,
-    NTOperatorMax
+    NTOperatorMax,
+    // Shifts are never produced by the parser, only by the optimiser.  The
+    // right-hand side is always a literal.  Right shifts round towards zero,
+    // so that they are equivalent to division by a power of two.
+    NTOperatorShl,
+    NTOperatorShr,
+    // A neighbours loop whose body is made entirely of reductions, which can
+    // be evaluated in any order.  Produced by the optimiser, with the same
+    // operands as NTNeighbours.
+    NTReductions,
+    // The statements in the body of an NTReductions node.  The first operand
+    // is the register that accumulates the result and the second is the
+    // value taken from each neighbour: a0 for sums, minima and maxima, and a
+    // literal or a range map over a0 with literal arms for counts.
+    NTReduceSum,
+    NTReduceMin,
+    NTReduceMax,
+    NTReduceCount
   } type;
   uintptr_t val[2];
 };
@@ -46,10 +65,207 @@ struct RangeMap {
   struct RangeMapEntry entries[0];
 };
 
+// A program compiled to bytecode for the interpreter.
+struct bytecode;
+// A pool of threads that run each generation in bands of rows.
+struct threadPool;
+// A Hashlife universe holding a grid.
+struct hashlife;
+// The tiles of a grid, and which of them changed in the last generation.
+struct tileGrid;
+// A grid of cells that are either 0 or 1, packed into bits.
+struct bitGrid;
+// The transition table of an outer totalistic program.
+struct ruleTable;
+// A grid that keeps the neighbour sum of every cell, for incremental updates.
+struct incrementalGrid;
+// A program compiled to a tree of closures.
+struct closures;
+// A program compiled for the batched interpreter.
+struct batchProgram;
+// A program being compiled on a background thread.
+struct tieredCompiler;
+// A JIT compiler.  It loads the runtime and works out what to generate code
+// for once, so it is worth keeping for several compiles.  Each automaton that
+// it compiles gets an LLVM context of its own, so different compilers can be
+// used on different threads at the same time.
+struct jitCompiler;
+
 void printAST(struct ASTNode *ast);
-void runOneStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct ASTNode **ast, uintptr_t count);
+// Optimises the program in place, returning the new number of statements.
+uintptr_t optimiseAST(struct ASTNode **ast, uintptr_t count);
+// Returns a mask of the local registers that may be read before they are
+// written, which must be zeroed at the start of each cell.
+uint16_t liveLocalRegisters(struct ASTNode **ast, uintptr_t count);
+struct bytecode *compileBytecode(struct ASTNode **ast, uintptr_t count);
+// Runs one generation.  If tiles is not NULL, only the tiles that might have
+// changed are recomputed.
+void runOneStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct bytecode *code, struct threadPool *pool, struct tileGrid *tiles);
+struct closures *compileClosures(struct ASTNode **ast, uintptr_t count);
+void runClosureStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct closures *program, struct threadPool *pool, struct tileGrid *tiles);
+// The batched interpreter runs several adjacent cells at once, so it only
+// works for programs that don't write to the global registers.
+struct batchProgram *compileBatch(struct ASTNode **ast, uintptr_t count);
+void runBatchStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct batchProgram *program, struct threadPool *pool, struct tileGrid *tiles);
+int16_t interpretCell(struct bytecode *code, const int16_t *cell, const struct neighbourhood *n);
+int usesGlobalRegisters(struct ASTNode **ast, uintptr_t count);
+int isOuterTotalistic(struct ASTNode **ast, uintptr_t count);
+int writesGlobalRegisters(struct ASTNode **ast, uintptr_t count);
+// Adds some bytes to an FNV-1a hash, which should start as FNVOffsetBasis.
+#define FNVOffsetBasis 14695981039346656037ULL
+uint64_t fnvHash(uint64_t hash, const void *data, size_t length);
+// Returns a hash of the structure of a program.
+uint64_t hashProgram(struct ASTNode **ast, uintptr_t count);
+// Processes the rows [rowBegin, rowEnd) of one generation.
+typedef void(*bandFn)(void *context, int16_t rowBegin, int16_t rowEnd);
+struct threadPool *createThreadPool(int threads);
+void destroyThreadPool(struct threadPool *pool);
+// Returns the number of threads in pool, including the caller (1 if NULL).
+// Passing this as the number of rows to runInBands() gives each thread
+// exactly one band, and all of the bands then run at the same time.
+int threadPoolSize(struct threadPool *pool);
+// Splits rows into one band per thread and runs fn on each, returning once
+// all of them have finished.  A NULL pool runs everything on this thread.
+void runInBands(struct threadPool *pool, int16_t rows, bandFn fn, void *context);
+// Called on each iteration of a loop that spins waiting for another thread,
+// with the number of iterations so far.
+void spinPause(int spins);
+// Processes the cells in rows [xBegin, xEnd) and columns [yBegin, yEnd) of
+// one generation.
+typedef void(*regionFn)(void *context, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t yEnd);
+struct tileGrid *createTileGrid(int16_t width, int16_t height);
+void destroyTileGrid(struct tileGrid *tiles);
+// Runs fn over every tile that might change in this generation, split across
+// the threads in pool (if any).  Only valid for programs that don't use the
+// global registers.
+void runTiles(struct tileGrid *tiles, int16_t *oldgrid, int16_t *newgrid, regionFn fn, void *context, struct threadPool *pool);
+// Computes one generation of the cells in rows [xBegin, xEnd) and columns
+// [yBegin, yEnd) of oldgrid, storing them in newgrid.
+typedef void(*kernelFn)(void *program, int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t yEnd);
+void interpretRegion(void *code, int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t yEnd);
+void runClosureRegion(void *program, int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t yEnd);
+// Advances the grid by the specified number of generations at once, in bands
+// of rows that fit in the cache.  Only valid for programs that don't use the
+// global registers.
+void runBlocked(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int generations, kernelFn fn, void *program, struct threadPool *pool);
+// Advances the grid by the specified number of generations, with each thread
+// in pool computing a different generation and following the previous one
+// down the grid.  The result ends up in oldgrid if the number of generations
+// is even and in newgrid if it is odd.  Only valid for programs that don't
+// use the global registers.
+void runPipelined(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int generations, kernelFn fn, void *program, struct threadPool *pool);
+// Hashlife only works for programs that don't use the global registers.
+struct hashlife *createHashlife(struct bytecode *code, int16_t *grid, int16_t width, int16_t height);
+void runHashlife(struct hashlife *h, int generations);
+// Copies the current state back into a grid.
+void readHashlife(struct hashlife *h, int16_t *grid);
+// The bit-packed engine only works for outer totalistic programs.  Returns
+// NULL if the program can produce values other than 0 and 1.
+struct bitGrid *createBitGrid(struct bytecode *code, int16_t *grid, int16_t width, int16_t height);
+void runBitGrid(struct bitGrid *b, int generations, struct threadPool *pool);
+void readBitGrid(struct bitGrid *b, int16_t *grid);
+void destroyBitGrid(struct bitGrid *b);
+// Returns the rule as a mask of the neighbour counts for which a cell that is
+// 0 (born) or 1 (survive) becomes 1.
+void bitGridRule(struct bitGrid *b, uint16_t *born, uint16_t *survive);
+// A compiled bit-packed automaton that computes rows [rowBegin, rowEnd).
+typedef void(*bitAutomaton)(uint64_t *rows, uint64_t *next, int16_t width, int words, uint64_t tailMask, int16_t rowBegin, int16_t rowEnd);
+// Makes the bit-packed engine use a compiled version of its rule.
+void setBitAutomaton(struct bitGrid *b, bitAutomaton compiled);
+// Tabulates an outer totalistic program for cells that start with values from
+// 0 to maxValue.  Returns NULL if the program doesn't keep the cells within a
+// small range of non-negative values.
+struct ruleTable *createRuleTable(struct bytecode *code, int maxValue);
+void destroyRuleTable(struct ruleTable *table);
+void runRuleTable(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct ruleTable *table, struct threadPool *pool, struct tileGrid *tiles);
+// Runs a transition table, only looking at cells whose value or neighbour sum
+// changed in the last generation.
+struct incrementalGrid *createIncrementalGrid(struct ruleTable *table, int16_t *grid, int16_t width, int16_t height);
+void runIncrementalGrid(struct incrementalGrid *inc, int generations);
+void readIncrementalGrid(struct incrementalGrid *inc, int16_t *grid);
+void destroyIncrementalGrid(struct incrementalGrid *inc);
 typedef void(*automaton)(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height);
-automaton compile(struct ASTNode **ast, uintptr_t count, int optimiseLevel);
+// A compiled automaton that only computes the rows [rowBegin, rowEnd).
+typedef void(*rowAutomaton)(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t rowBegin, int16_t rowEnd);
+// A compiled automaton that only computes the cells in rows [xBegin, xEnd)
+// and columns [yBegin, yEnd).
+typedef void(*regionAutomaton)(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t yEnd);
+// A compiled automaton.  The entry points that weren't compiled are NULL.
+struct compiledAutomaton {
+  automaton ca;
+  rowAutomaton rows;
+  regionAutomaton region;
+  bitAutomaton bits;
+  // The execution engine that owns the machine code and the IR
+  void *engine;
+  // The LLVM context that the IR's types and constants live in
+  void *context;
+};
+struct jitCompiler *createJITCompiler(void);
+// Destroys a compiler.  The automata that it compiled stay valid until they
+// are freed.
+void destroyJITCompiler(struct jitCompiler *c);
+// Frees the machine code and IR of a compiled automaton.
+void freeAutomaton(struct compiledAutomaton *a);
+// Compiles the program, with its whole-grid, row-range and region entry
+// points.
+struct compiledAutomaton *compile(struct jitCompiler *c, struct ASTNode **ast, uintptr_t count, int optimiseLevel);
+// Compiles the program for the specified CPU ("generic" for any machine of
+// this architecture, "native" for this one) and writes it to filename as a
+// native object.  The object exports automaton, automatonRows,
+// automatonRegion, automatonProgramHash (the value of hashProgram() for the
+// program), and automatonTargetCPU and automatonTargetFeatures (the strings
+// that the code was generated for).  Returns 0 on success.
+int compileToObject(struct jitCompiler *c, struct ASTNode **ast, uintptr_t count, int optimiseLevel, const char *cpu, const char *filename);
+// Returns the name of the CPU that this machine has, as used by
+// compileToObject().
+const char *hostCPUName(void);
+// Compiles a bit-packed version of a two-state outer totalistic rule.
+struct compiledAutomaton *compileBitAutomaton(struct jitCompiler *c, uint16_t born, uint16_t survive, int optimiseLevel);
+// Keeps the objects generated by the compiler in the specified directory, and
+// reuses them when the same program is compiled again.  NULL disables this.
+// This must be called before any compilers are created.
+void setObjectCacheDirectory(const char *directory);
+// Starts compiling the program on a background thread, first without
+// optimisation and then (if it is higher) at the specified level.
+struct tieredCompiler *startTieredCompiler(struct ASTNode **ast, uintptr_t count, int optimiseLevel);
+// Returns the number of tiers that have been compiled so far.  If this is not
+// zero, the entry points of the most recent one are returned in the pointers.
+int latestTier(struct tieredCompiler *t, automaton *ca, rowAutomaton *rows, regionAutomaton *region);
+// Frees the compiler and the tiers that it compiled.  A compile that is still
+// in progress is left to finish on its own thread, which then frees them, and
+// 1 is returned.  The process must then end with _exit(), because running
+// LLVM's static destructors would pull LLVM out from under the compile.
+int finishTieredCompiler(struct tieredCompiler *t);
+// How fast each backend runs on this machine, and how long compiling takes.
+// Index 0 of each array is for unoptimised code and index 1 is for code
+// compiled at OptimisedLevel.
+struct hostProfile {
+  // Seconds per operation in the interpreter
+  double interpretSeconds;
+  // Seconds per operation in compiled code
+  double compiledSeconds[2];
+  // Seconds to compile a program
+  double compileSeconds[2];
+};
+// The backends that chooseBackend() picks between
+enum { BackendInterpreter, BackendCompiled, BackendOptimised };
+// The optimisation level used for BackendOptimised
+enum { OptimisedLevel = 2 };
+// Fills in rough defaults for hosts that haven't been calibrated.
+void defaultProfile(struct hostProfile *p);
+// Returns the name of this user's profile file.
+const char *profileFile(void);
+// Reads or writes a profile.  Both return 0 on success.
+int readProfile(struct hostProfile *p, const char *filename);
+int writeProfile(struct hostProfile *p, const char *filename);
+// Measures this host by running the program in each backend.
+void calibrateProfile(struct hostProfile *p, struct ASTNode **ast, uintptr_t count);
+// Estimates the number of operations per cell in a generation of a program.
+uintptr_t programCost(struct ASTNode **ast, uintptr_t count);
+// Returns the backend that should finish the specified number of operations
+// soonest, storing the estimated time for each backend in estimates.
+int chooseBackend(struct hostProfile *p, double operations, int threads, double estimates[3]);
 #ifdef __cplusplus
 }
 #endif
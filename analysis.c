@@ -0,0 +1,168 @@
+#include "AST.h"
+
+// Analyses of programs, used to decide which execution strategies preserve
+// the program's semantics.
+
+// Returns whether an AST-encoded value (a register, a literal or a pointer to
+// an expression or statement) refers to any of the global registers.
+static int valueUsesGlobals(uintptr_t val) {
+  if ((val & 3) == 3) {
+    val >>= 2;
+    return (val >= 10) && (val < 20);
+  }
+  if (val & 1) {
+    return 0;
+  }
+  struct ASTNode *ast = (struct ASTNode*)val;
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions:
+      return usesGlobalRegisters((struct ASTNode**)ast->val[1], ast->val[0]);
+    case NTRangeMap: {
+      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
+      if (valueUsesGlobals(rm->value)) {
+        return 1;
+      }
+      for (int i=0 ; i<rm->count ; i++) {
+        if (valueUsesGlobals(rm->entries[i].val)) {
+          return 1;
+        }
+      }
+      return 0;
+    }
+    default:
+      return valueUsesGlobals(ast->val[0]) || valueUsesGlobals(ast->val[1]);
+  }
+}
+
+// The global registers persist from one cell to the next, so a program that
+// uses them depends on the order in which cells are visited.
+int usesGlobalRegisters(struct ASTNode **ast, uintptr_t count) {
+  for (uintptr_t i=0 ; i<count ; i++) {
+    if (valueUsesGlobals((uintptr_t)ast[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns whether a list of statements only looks at the neighbours through
+// loops that add up their values.
+static int onlySumsNeighbours(struct ASTNode **ast, uintptr_t count) {
+  for (uintptr_t i=0 ; i<count ; i++) {
+    if ((uintptr_t)ast[i] & 1) {
+      continue;
+    }
+    if (ast[i]->type == NTNeighbours) {
+      return 0;
+    }
+    if (ast[i]->type == NTReductions) {
+      struct ASTNode **body = (struct ASTNode**)ast[i]->val[1];
+      for (uintptr_t j=0 ; j<ast[i]->val[0] ; j++) {
+        if (body[j]->type != NTReduceSum) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// A program is outer totalistic if the new value of a cell depends only on
+// its old value and the sum of its neighbours.  This must be called on the
+// optimised AST, where neighbours loops that just add up the neighbours have
+// been turned into reductions.  Any other use of the neighbours might depend
+// on their order or on how many of them there are (which is different on the
+// edges of the grid), and the global registers carry state between cells.
+int isOuterTotalistic(struct ASTNode **ast, uintptr_t count) {
+  return !usesGlobalRegisters(ast, count) && onlySumsNeighbours(ast, count);
+}
+
+// Returns whether any statement in a list stores to a global register.
+// Programs that only read them always see zero.
+int writesGlobalRegisters(struct ASTNode **ast, uintptr_t count) {
+  for (uintptr_t i=0 ; i<count ; i++) {
+    if ((uintptr_t)ast[i] & 1) {
+      continue;
+    }
+    switch (ast[i]->type) {
+      case NTNeighbours:
+      case NTReductions:
+        if (writesGlobalRegisters((struct ASTNode**)ast[i]->val[1],
+                                  ast[i]->val[0])) {
+          return 1;
+        }
+        break;
+      case NTRangeMap:
+        break;
+      default: {
+        uintptr_t reg = ast[i]->val[0] >> 2;
+        if ((reg >= 10) && (reg < 20)) {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// FNV-1a, which is simple and good enough for naming cache entries.
+static const uint64_t FNVPrime = 1099511628211ULL;
+
+uint64_t fnvHash(uint64_t hash, const void *data, size_t length) {
+  const unsigned char *bytes = data;
+  for (size_t i=0 ; i<length ; i++) {
+    hash ^= bytes[i];
+    hash *= FNVPrime;
+  }
+  return hash;
+}
+
+static uint64_t hashWord(uint64_t hash, int64_t word) {
+  return fnvHash(hash, &word, sizeof(word));
+}
+
+static uint64_t hashStatements(uint64_t hash, struct ASTNode **ast,
+                               uintptr_t count);
+
+// Hashes an AST-encoded value by its structure, so that the same program
+// always gets the same hash, wherever its nodes happen to be allocated.
+static uint64_t hashValue(uint64_t hash, uintptr_t val) {
+  // Registers and literals encode their own meaning
+  if (val & 1) {
+    return hashWord(hash, val);
+  }
+  struct ASTNode *ast = (struct ASTNode*)val;
+  hash = hashWord(hash, ast->type);
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions:
+      return hashStatements(hash, (struct ASTNode**)ast->val[1], ast->val[0]);
+    case NTRangeMap: {
+      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
+      hash = hashValue(hash, rm->value);
+      hash = hashWord(hash, rm->count);
+      for (int i=0 ; i<rm->count ; i++) {
+        hash = hashWord(hash, rm->entries[i].min);
+        hash = hashWord(hash, rm->entries[i].max);
+        hash = hashValue(hash, rm->entries[i].val);
+      }
+      return hash;
+    }
+    default:
+      return hashValue(hashValue(hash, ast->val[0]), ast->val[1]);
+  }
+}
+
+static uint64_t hashStatements(uint64_t hash, struct ASTNode **ast,
+                               uintptr_t count) {
+  hash = hashWord(hash, count);
+  for (uintptr_t i=0 ; i<count ; i++) {
+    hash = hashValue(hash, (uintptr_t)ast[i]);
+  }
+  return hash;
+}
+
+uint64_t hashProgram(struct ASTNode **ast, uintptr_t count) {
+  return hashStatements(FNVOffsetBasis, ast, count);
+}
@@ -0,0 +1,535 @@
+#include "interpreter.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// The batched interpreter.  The other interpreters pay the cost of dispatching
+// on every node once per cell.  This one keeps each register as a vector with
+// one lane for each of BatchSize adjacent cells in a row, and runs each node
+// for all of them at once, so dispatch is paid once per batch and the
+// arithmetic uses SIMD instructions.
+//
+// Neighbours loops run for different numbers of iterations in cells on the
+// edges of the grid, so statements inside them only update the lanes that are
+// still active.  Range maps find the arm for each lane and then evaluate each
+// arm that some lane needs, taking the result for the lanes that chose it.
+//
+// Cells in a batch are processed together, so the global registers can't
+// carry anything from one cell to the next.  Programs that never write to
+// them see them as zero, which is the same in every engine.
+
+enum { BatchSize = 16 };
+
+// A value for each cell in a batch.  Values are computed as ints, and are
+// truncated to 16 bits when they are stored in a register, as in the other
+// interpreters.
+typedef int32_t lanes __attribute__((vector_size(BatchSize * sizeof(int32_t))));
+typedef uint32_t unsignedLanes __attribute__((vector_size(BatchSize * sizeof(uint32_t))));
+
+enum batchKind {
+  BatchConstant,
+  BatchLoad,
+  BatchRangeMap,
+  BatchArithmetic,
+  BatchShl,
+  BatchShr,
+  BatchNeighbours,
+  BatchReductions,
+  BatchReduceSum,
+  BatchReduceMin,
+  BatchReduceMax,
+  BatchReduceCount,
+  BatchReduceMap
+};
+
+struct batchNode {
+  enum batchKind kind;
+  // The AST node type, for arithmetic
+  int op;
+  // The destination register slot (or the key for range maps)
+  int16_t reg;
+  // The source register slot
+  int16_t src;
+  // An immediate value
+  int32_t imm;
+  // The number of children
+  int count;
+  // The children: the right-hand side of an operation, the arms of a range
+  // map or the body of a neighbours loop.  NULL entries in loop bodies are
+  // statements that do nothing, but a0 is still loaded before them.
+  const struct batchNode **children;
+  // The preprocessed lookup for a range map
+  const struct rangeLookup *lookup;
+};
+
+struct batchProgram {
+  uintptr_t count;
+  const struct batchNode **list;
+};
+
+struct batchState {
+  // The registers, indexed by slot number
+  lanes reg[SlotCount];
+  // All ones in the lanes that are executing, zero in the others
+  lanes active;
+  // The old grid
+  const int16_t *grid;
+  // The index of each lane's cell in the grid, and its neighbours
+  int index[BatchSize];
+  const struct neighbourhood *n[BatchSize];
+  // Set if the lanes are adjacent cells that all have the same neighbours
+  int contiguous;
+  // The largest number of neighbours of any lane
+  int maxCount;
+};
+
+// The helpers below take and return lanes through pointers, because passing
+// 64-byte vectors by value depends on whether the target has AVX-512, and
+// gcc warns about that ABI difference.
+
+// Sets every lane of v to value
+static inline void splat(lanes *v, int value) {
+  for (int j=0 ; j<BatchSize ; j++) {
+    (*v)[j] = value;
+  }
+}
+
+// Replaces the lanes of v where mask is all ones with those of a
+static inline void blend(lanes *v, const lanes *mask, const lanes *a) {
+  *v = (*mask & *a) | (~*mask & *v);
+}
+
+// Stores value in a register, in the active lanes
+static inline void store(struct batchState *s, int slot, const lanes *value) {
+  lanes sixteen;
+  splat(&sixteen, 16);
+  lanes truncated = (*value << sixteen) >> sixteen;
+  blend(&s->reg[slot], &s->active, &truncated);
+}
+
+// Sets mask to all ones in the lanes that have at least k+1 neighbours
+static inline void hasNeighbour(lanes *mask, struct batchState *s, int k) {
+  if (s->contiguous) {
+    splat(mask, k < s->n[0]->count ? -1 : 0);
+    return;
+  }
+  for (int j=0 ; j<BatchSize ; j++) {
+    (*mask)[j] = k < s->n[j]->count ? -1 : 0;
+  }
+}
+
+// Loads the value of neighbour k for each lane, or 0 in lanes that don't
+// have that many neighbours.
+static inline void loadNeighbour(lanes *v, struct batchState *s, int k) {
+  if (s->contiguous) {
+    const int16_t *p = &s->grid[s->index[0] + s->n[0]->offsets[k]];
+    for (int j=0 ; j<BatchSize ; j++) {
+      (*v)[j] = p[j];
+    }
+    return;
+  }
+  for (int j=0 ; j<BatchSize ; j++) {
+    const struct neighbourhood *n = s->n[j];
+    (*v)[j] = (k < n->count) ? s->grid[s->index[j] + n->offsets[k]] : 0;
+  }
+}
+
+static void runStatement(const struct batchNode *c, struct batchState *s);
+
+static void evaluate(lanes *result, const struct batchNode *c,
+                     struct batchState *s)
+{
+  switch (c->kind) {
+    case BatchConstant:
+      splat(result, c->imm);
+      return;
+    case BatchLoad:
+      *result = s->reg[c->src];
+      return;
+    case BatchRangeMap: {
+      lanes key = s->reg[c->reg];
+      int arms[BatchSize];
+      for (int j=0 ; j<BatchSize ; j++) {
+        arms[j] = findArm(c->lookup, key[j]);
+      }
+      // Evaluate each arm that some lane chose, and give its value to all of
+      // the lanes that chose it.  Lanes that match no arm get 0.
+      splat(result, 0);
+      int done[BatchSize] = {0};
+      for (int j=0 ; j<BatchSize ; j++) {
+        if (done[j] || (arms[j] < 0)) continue;
+        lanes value;
+        evaluate(&value, c->children[arms[j]], s);
+        for (int l=j ; l<BatchSize ; l++) {
+          if (arms[l] == arms[j]) {
+            (*result)[l] = value[l];
+            done[l] = 1;
+          }
+        }
+      }
+      return;
+    }
+    default:
+      assert(0 && "Not an expression");
+      splat(result, 0);
+  }
+}
+
+static void arithmetic(const struct batchNode *c, struct batchState *s) {
+  lanes l = s->reg[c->reg];
+  lanes rv;
+  evaluate(&rv, c->children[0], s);
+  lanes result;
+  lanes mask;
+  switch (c->op) {
+    case NTOperatorAdd: result = l + rv; break;
+    case NTOperatorSub: result = l - rv; break;
+    case NTOperatorMul: result = l * rv; break;
+    case NTOperatorAssign: result = rv; break;
+    case NTOperatorMin:
+      result = rv;
+      mask = rv > l;
+      blend(&result, &mask, &l);
+      break;
+    case NTOperatorMax:
+      result = rv;
+      mask = rv < l;
+      blend(&result, &mask, &l);
+      break;
+    case NTOperatorDiv:
+      // Division isn't vectorised, and inactive lanes mustn't trap.
+      for (int j=0 ; j<BatchSize ; j++) {
+        result[j] = s->active[j] ? l[j] / rv[j] : l[j];
+      }
+      break;
+    default:
+      assert(0 && "Unknown operator");
+      return;
+  }
+  store(s, c->reg, &result);
+}
+
+static void neighbours(const struct batchNode *c, struct batchState *s) {
+  lanes outer = s->active;
+  for (int k=0 ; k<s->maxCount ; k++) {
+    lanes mask;
+    hasNeighbour(&mask, s, k);
+    s->active = outer & mask;
+    lanes nv;
+    loadNeighbour(&nv, s, k);
+    for (int i=0 ; i<c->count ; i++) {
+      blend(&s->reg[SlotA], &s->active, &nv);
+      if (c->children[i]) {
+        runStatement(c->children[i], s);
+      }
+    }
+  }
+  s->active = outer;
+}
+
+static void reduce(const struct batchNode *c, struct batchState *s) {
+  lanes acc = s->reg[c->reg];
+  for (int k=0 ; k<s->maxCount ; k++) {
+    lanes mask;
+    hasNeighbour(&mask, s, k);
+    lanes nv;
+    loadNeighbour(&nv, s, k);
+    lanes next;
+    lanes keep;
+    switch (c->kind) {
+      case BatchReduceSum: next = acc + nv; break;
+      case BatchReduceMin:
+        next = nv;
+        keep = nv > acc;
+        blend(&next, &keep, &acc);
+        break;
+      case BatchReduceMax:
+        next = nv;
+        keep = nv < acc;
+        blend(&next, &keep, &acc);
+        break;
+      case BatchReduceMap: {
+        for (int j=0 ; j<BatchSize ; j++) {
+          int arm = findArm(c->lookup, nv[j]);
+          next[j] = acc[j] + ((arm < 0) ? 0 : c->children[arm]->imm);
+        }
+        break;
+      }
+      default:
+        assert(0 && "Unknown reduction");
+        return;
+    }
+    blend(&acc, &mask, &next);
+  }
+  store(s, c->reg, &acc);
+}
+
+static void runStatement(const struct batchNode *c, struct batchState *s) {
+  switch (c->kind) {
+    case BatchArithmetic:
+      arithmetic(c, s);
+      break;
+    case BatchShl: {
+      lanes l = s->reg[c->reg];
+      lanes shift;
+      splat(&shift, c->imm);
+      lanes result = (lanes)((unsignedLanes)l << (unsignedLanes)shift);
+      store(s, c->reg, &result);
+      break;
+    }
+    case BatchShr: {
+      // Adding 2^imm-1 to negative values makes the shift round towards zero
+      lanes l = s->reg[c->reg];
+      lanes sign, low, shift;
+      splat(&sign, 31);
+      splat(&low, (1 << c->imm) - 1);
+      splat(&shift, c->imm);
+      lanes result = (l + ((l >> sign) & low)) >> shift;
+      store(s, c->reg, &result);
+      break;
+    }
+    case BatchNeighbours:
+      neighbours(c, s);
+      break;
+    case BatchReductions:
+      for (int i=0 ; i<c->count ; i++) {
+        runStatement(c->children[i], s);
+      }
+      break;
+    case BatchReduceSum:
+    case BatchReduceMin:
+    case BatchReduceMax:
+    case BatchReduceMap:
+      reduce(c, s);
+      break;
+    case BatchReduceCount: {
+      lanes count, imm;
+      for (int j=0 ; j<BatchSize ; j++) {
+        count[j] = s->n[j]->count;
+      }
+      splat(&imm, c->imm);
+      lanes result = s->reg[c->reg] + imm * count;
+      store(s, c->reg, &result);
+      break;
+    }
+    default:
+      assert(0 && "Not a statement");
+  }
+}
+
+static struct batchNode *newNode(enum batchKind kind) {
+  struct batchNode *c = calloc(1, sizeof(struct batchNode));
+  c->kind = kind;
+  return c;
+}
+
+static const struct batchNode *compileStatement(struct ASTNode *ast);
+
+// Builds the node for an expression: a register, a literal or a range map.
+static const struct batchNode *compileExpression(uintptr_t val) {
+  if ((val & 3) == 3) {
+    int slot = readSlot(val);
+    // Undefined registers always read as -1
+    if (slot < 0) {
+      struct batchNode *c = newNode(BatchConstant);
+      c->imm = -1;
+      return c;
+    }
+    struct batchNode *c = newNode(BatchLoad);
+    c->src = slot;
+    return c;
+  }
+  if (val & 1) {
+    struct batchNode *c = newNode(BatchConstant);
+    c->imm = (int)(val >> 2);
+    return c;
+  }
+  return compileStatement((struct ASTNode*)val);
+}
+
+// Builds the nodes for a list of statements.  Statements that do nothing are
+// left as NULL.
+static const struct batchNode **compileList(struct ASTNode **list,
+                                            uintptr_t count)
+{
+  const struct batchNode **nodes = calloc(count, sizeof(struct batchNode*));
+  for (uintptr_t i=0 ; i<count ; i++) {
+    // Literals and registers are valid statements, but do nothing.  Range
+    // expressions have no side effects, so evaluating one as a statement does
+    // nothing either.
+    if (!((uintptr_t)list[i] & 1) && (list[i]->type != NTRangeMap)) {
+      nodes[i] = compileStatement(list[i]);
+    }
+  }
+  return nodes;
+}
+
+static const struct batchNode *compileStatement(struct ASTNode *ast) {
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions: {
+      struct batchNode *c = newNode((ast->type == NTNeighbours) ?
+          BatchNeighbours : BatchReductions);
+      c->children = compileList((struct ASTNode**)ast->val[1], ast->val[0]);
+      c->count = ast->val[0];
+      return c;
+    }
+    case NTRangeMap: {
+      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
+      struct batchNode *c = newNode(BatchRangeMap);
+      int slot = readSlot(rm->value);
+      assert(((rm->value & 3) == 3) && (slot >= 0) &&
+          "Range maps must map a register");
+      c->reg = slot;
+      c->lookup = buildRangeLookup(rm);
+      c->children = calloc(rm->count, sizeof(struct batchNode*));
+      for (int i=0 ; i<rm->count ; i++) {
+        c->children[i] = compileExpression(rm->entries[i].val);
+      }
+      c->count = rm->count;
+      return c;
+    }
+    case NTReduceSum:
+    case NTReduceMin:
+    case NTReduceMax:
+    case NTReduceCount: {
+      static const enum batchKind kinds[] = {
+        [NTReduceSum] = BatchReduceSum,
+        [NTReduceMin] = BatchReduceMin,
+        [NTReduceMax] = BatchReduceMax,
+        [NTReduceCount] = BatchReduceCount
+      };
+      uintptr_t arg = ast->val[1];
+      struct batchNode *c;
+      if ((ast->type == NTReduceCount) && !(arg & 1)) {
+        struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)arg)->val[0];
+        c = newNode(BatchReduceMap);
+        c->lookup = buildRangeLookup(rm);
+        c->children = calloc(rm->count, sizeof(struct batchNode*));
+        for (int i=0 ; i<rm->count ; i++) {
+          c->children[i] = compileExpression(rm->entries[i].val);
+        }
+        c->count = rm->count;
+      } else {
+        c = newNode(kinds[ast->type]);
+        c->imm = (int)(arg >> 2);
+      }
+      c->reg = writeSlot(ast->val[0]);
+      return c;
+    }
+    case NTOperatorShl:
+    case NTOperatorShr: {
+      int slot = writeSlot(ast->val[0]);
+      if (slot < 0) {
+        return NULL;
+      }
+      struct batchNode *c =
+        newNode((ast->type == NTOperatorShl) ? BatchShl : BatchShr);
+      c->reg = slot;
+      c->imm = (int)(ast->val[1] >> 2);
+      return c;
+    }
+    case NTOperatorAdd:
+    case NTOperatorSub:
+    case NTOperatorMul:
+    case NTOperatorDiv:
+    case NTOperatorAssign:
+    case NTOperatorMin:
+    case NTOperatorMax: {
+      // Writes to undefined registers are discarded, and expressions have
+      // no side effects, so the whole statement can be dropped.
+      int slot = writeSlot(ast->val[0]);
+      if (slot < 0) {
+        return NULL;
+      }
+      struct batchNode *c = newNode(BatchArithmetic);
+      c->op = ast->type;
+      c->reg = slot;
+      c->children = calloc(1, sizeof(struct batchNode*));
+      c->children[0] = compileExpression(ast->val[1]);
+      c->count = 1;
+      return c;
+    }
+  }
+  return NULL;
+}
+
+struct batchProgram *compileBatch(struct ASTNode **ast, uintptr_t count)
+{
+  struct batchProgram *program = calloc(1, sizeof(struct batchProgram));
+  program->list = compileList(ast, count);
+  program->count = count;
+  return program;
+}
+
+// The arguments for running a batched program over a band of rows
+struct batchStep {
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+  struct batchProgram *program;
+};
+
+// Runs the cells in rows [xBegin, xEnd) and columns [yBegin, yEnd) of a
+// single step, BatchSize cells at a time.
+static void runRegion(void *context, int16_t xBegin, int16_t xEnd,
+                      int16_t yBegin, int16_t yEnd)
+{
+  struct batchStep *step = context;
+  struct batchProgram *program = step->program;
+  struct neighbourhood neighbourhoods[16];
+  buildNeighbourhoods(neighbourhoods, step->height);
+  struct batchState s;
+  s.grid = step->oldgrid;
+  for (int x=xBegin ; x<xEnd ; x++) {
+    for (int y=yBegin ; y<yEnd ; y+=BatchSize) {
+      // The last batch in a row may be short.  Its spare lanes repeat the
+      // last cell, so that they don't read outside the grid, and their
+      // results are thrown away.
+      int cells = (yEnd - y < BatchSize) ? yEnd - y : BatchSize;
+      s.maxCount = 0;
+      s.contiguous = (cells == BatchSize);
+      for (int j=0 ; j<BatchSize ; j++) {
+        int cy = y + ((j < cells) ? j : cells - 1);
+        s.index[j] = gridIndex(x, cy, step->height);
+        s.n[j] =
+          &neighbourhoods[neighbourClass(x, cy, step->width, step->height)];
+        if (s.n[j]->count > s.maxCount) {
+          s.maxCount = s.n[j]->count;
+        }
+        s.contiguous &= (s.n[j] == s.n[0]);
+      }
+      for (int r=0 ; r<SlotCount ; r++) {
+        splat(&s.reg[r], 0);
+      }
+      for (int j=0 ; j<BatchSize ; j++) {
+        s.reg[SlotV][j] = step->oldgrid[s.index[j]];
+      }
+      splat(&s.active, -1);
+      for (uintptr_t i=0 ; i<program->count ; i++) {
+        if (program->list[i]) {
+          runStatement(program->list[i], &s);
+        }
+      }
+      for (int j=0 ; j<cells ; j++) {
+        step->newgrid[s.index[j]] = s.reg[SlotV][j];
+      }
+    }
+  }
+}
+
+static void runRows(void *context, int16_t rowBegin, int16_t rowEnd)
+{
+  struct batchStep *step = context;
+  runRegion(context, rowBegin, rowEnd, 0, step->height);
+}
+
+void runBatchStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct batchProgram *program, struct threadPool *pool, struct tileGrid *tiles)
+{
+  struct batchStep step = { oldgrid, newgrid, width, height, program };
+  if (tiles) {
+    runTiles(tiles, oldgrid, newgrid, runRegion, &step, pool);
+  } else {
+    runInBands(pool, width, runRows, &step);
+  }
+}
@@ -0,0 +1,180 @@
+#include "AST.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A bit-packed engine for two-state outer totalistic programs.  Each cell is a
+// single bit, and a row of the grid is stored as 64-bit words, so every
+// operation works on 64 cells at once.  The neighbours of each cell are
+// added up with a network of bitwise full adders, which produces the four
+// bits of each cell's neighbour count in four separate words, and the rule is
+// then applied as a boolean function of those bits and the cell's own bit.
+//
+// The rule is never interpreted per cell.  Because the program is outer
+// totalistic, it is completely described by what it does for each old value
+// (0 or 1) and each neighbour count (0 to 8), so those 18 cases are run once
+// through the bytecode interpreter up front.
+
+struct bitGrid {
+  int16_t width;
+  int16_t height;
+  // The number of words in each row
+  int words;
+  // Mask of the bits in the last word of each row that hold cells
+  uint64_t tailMask;
+  // The rows of the current and next generations.  There is an extra row of
+  // zeroes above and below the grid, so that the first and last rows don't
+  // need special cases.
+  uint64_t *rows;
+  uint64_t *next;
+  // Bit n is set if a cell with value 0 (born) or 1 (survive) and n neighbours
+  // with value 1 becomes 1.
+  uint16_t born;
+  uint16_t survive;
+  // The compiled version of the rule, if there is one
+  bitAutomaton compiled;
+};
+
+struct bitGrid *createBitGrid(struct bytecode *code, int16_t *grid,
+                              int16_t width, int16_t height)
+{
+  // Find the new value for each old value and neighbour count, in the middle
+  // of a block of 3x3 cells.
+  uint16_t rule[2] = { 0, 0 };
+  struct neighbourhood n = { 8, { -4, -3, -2, -1, 1, 2, 3, 4 } };
+  for (int v=0 ; v<2 ; v++) {
+    for (int sum=0 ; sum<=8 ; sum++) {
+      int16_t block[9] = {0};
+      block[4] = v;
+      for (int i=0 ; i<sum ; i++) {
+        block[4 + n.offsets[i]] = 1;
+      }
+      int16_t result = interpretCell(code, &block[4], &n);
+      // Rules that produce any other value aren't two-state
+      if ((result != 0) && (result != 1)) {
+        return NULL;
+      }
+      rule[v] |= result << sum;
+    }
+  }
+  struct bitGrid *b = calloc(1, sizeof(struct bitGrid));
+  b->width = width;
+  b->height = height;
+  b->words = bitRowWords(height);
+  b->tailMask = (height % 64) ? (((uint64_t)1) << (height % 64)) - 1 : ~(uint64_t)0;
+  b->rows = calloc((width + 2) * b->words, sizeof(uint64_t));
+  b->next = calloc((width + 2) * b->words, sizeof(uint64_t));
+  b->born = rule[0];
+  b->survive = rule[1];
+  for (int x=0 ; x<width ; x++) {
+    uint64_t *row = &b->rows[(x + 1) * b->words];
+    for (int y=0 ; y<height ; y++) {
+      if (grid[gridIndex(x, y, height)]) {
+        row[y / 64] |= ((uint64_t)1) << (y % 64);
+      }
+    }
+  }
+  return b;
+}
+
+void destroyBitGrid(struct bitGrid *b) {
+  if (b == NULL) {
+    return;
+  }
+  free(b->rows);
+  free(b->next);
+  free(b);
+}
+
+void readBitGrid(struct bitGrid *b, int16_t *grid) {
+  for (int x=0 ; x<b->width ; x++) {
+    uint64_t *row = &b->rows[(x + 1) * b->words];
+    for (int y=0 ; y<b->height ; y++) {
+      grid[gridIndex(x, y, b->height)] = (row[y / 64] >> (y % 64)) & 1;
+    }
+  }
+}
+
+// Adds three one-bit numbers in each bit position
+static inline void fullAdd(uint64_t a, uint64_t b, uint64_t c, uint64_t *sum,
+                           uint64_t *carry)
+{
+  uint64_t t = a ^ b;
+  *sum = t ^ c;
+  *carry = (a & b) | (t & c);
+}
+
+// Returns a mask of the bit positions where the neighbour count (in bits s0 to
+// s3) is one of the counts set in the counts mask.
+static inline uint64_t matchCounts(uint16_t counts, uint64_t s0, uint64_t s1,
+                                   uint64_t s2, uint64_t s3)
+{
+  uint64_t result = 0;
+  for (int n=0 ; n<=8 ; n++) {
+    if (counts & (1 << n)) {
+      result |= ((n & 1) ? s0 : ~s0) & ((n & 2) ? s1 : ~s1) &
+                ((n & 4) ? s2 : ~s2) & ((n & 8) ? s3 : ~s3);
+    }
+  }
+  return result;
+}
+
+void bitGridRule(struct bitGrid *b, uint16_t *born, uint16_t *survive) {
+  *born = b->born;
+  *survive = b->survive;
+}
+
+void setBitAutomaton(struct bitGrid *b, bitAutomaton compiled) {
+  b->compiled = compiled;
+}
+
+static void runBitRows(void *context, int16_t rowBegin, int16_t rowEnd) {
+  struct bitGrid *b = context;
+  if (b->compiled) {
+    b->compiled(b->rows, b->next, b->width, b->words, b->tailMask, rowBegin,
+        rowEnd);
+    return;
+  }
+  int words = b->words;
+  for (int x=rowBegin ; x<rowEnd ; x++) {
+    const uint64_t *above = &b->rows[x * words];
+    const uint64_t *row = &b->rows[(x + 1) * words];
+    const uint64_t *below = &b->rows[(x + 2) * words];
+    uint64_t *out = &b->next[(x + 1) * words];
+    for (int i=0 ; i<words ; i++) {
+      // Add up the eight neighbours.  Each full adder turns three bits of
+      // one weight into one bit of that weight and one of the next.
+      uint64_t s1, c1, s2, c2, s3, c3, s0, k1;
+      fullAdd(bitWest(above, i), above[i], bitEast(above, i, words), &s1, &c1);
+      fullAdd(bitWest(row, i), bitEast(row, i, words), bitWest(below, i), &s2, &c2);
+      s3 = below[i] ^ bitEast(below, i, words);
+      c3 = below[i] & bitEast(below, i, words);
+      fullAdd(s1, s2, s3, &s0, &k1);
+      // Now there are four bits of weight 2: c1, c2, c3 and k1
+      uint64_t t0, t1;
+      fullAdd(c1, c2, c3, &t0, &t1);
+      uint64_t bit1 = t0 ^ k1;
+      uint64_t t2 = t0 & k1;
+      // And two of weight 4, whose sum can't be more than 8
+      uint64_t bit2 = t1 ^ t2;
+      uint64_t bit3 = t1 & t2;
+      uint64_t cell = row[i];
+      uint64_t result =
+        (~cell & matchCounts(b->born, s0, bit1, bit2, bit3)) |
+        (cell & matchCounts(b->survive, s0, bit1, bit2, bit3));
+      // Keep the bits past the end of the row clear
+      if (i == words - 1) {
+        result &= b->tailMask;
+      }
+      out[i] = result;
+    }
+  }
+}
+
+void runBitGrid(struct bitGrid *b, int generations, struct threadPool *pool) {
+  for (int i=0 ; i<generations ; i++) {
+    runInBands(pool, b->width, runBitRows, b);
+    uint64_t *tmp = b->rows;
+    b->rows = b->next;
+    b->next = tmp;
+  }
+}
@@ -0,0 +1,102 @@
+#include "AST.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Temporal blocking.  Running one generation at a time streams the whole grid
+// through memory every generation, which makes large grids memory bound.
+// Instead, the grid is split into bands of rows that fit in the cache, and
+// each band is copied (along with k rows above and below it) into a pair of
+// scratch buffers and advanced k generations there before being written back.
+//
+// Each generation, the rows that can be computed correctly shrink by one at
+// each end, because the rows just outside them are out of date, so after k
+// generations exactly the band itself is correct.  The rows in the halo are
+// computed redundantly by neighbouring bands, which is the price of only
+// touching main memory once every k generations.
+//
+// Bands span whole rows, so the kernels handle the edges of the grid exactly
+// as they do normally.  Nothing is shared between cells except through the
+// grid, so this only works for programs that don't use the global registers.
+
+// The amount of cache (a typical L2) that the two scratch buffers for a band
+// should fit in
+static const int CacheBytes = 1024 * 1024;
+
+// The arguments for running blocks of generations over a band of rows
+struct blockedStep {
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+  int generations;
+  int bandRows;
+  kernelFn fn;
+  void *program;
+};
+
+static inline int minInt(int a, int b) {
+  return a < b ? a : b;
+}
+
+static inline int maxInt(int a, int b) {
+  return a > b ? a : b;
+}
+
+static void runBlockedRows(void *context, int16_t rowBegin, int16_t rowEnd) {
+  struct blockedStep *step = context;
+  int16_t width = step->width;
+  int16_t height = step->height;
+  int stride = gridStride(height);
+  int k = step->generations;
+  // Each buffer holds the band, the rows around it and a halo row at each
+  // end.  The halo columns are never written, so they stay zero.
+  int rows = step->bandRows + 2 * k + 2;
+  int16_t *buffers[2] = {
+    calloc(rows * stride, sizeof(int16_t)),
+    calloc(rows * stride, sizeof(int16_t))
+  };
+  for (int bandBegin=rowBegin ; bandBegin<rowEnd ; bandBegin+=step->bandRows) {
+    int bandEnd = minInt(bandBegin + step->bandRows, rowEnd);
+    int first = maxInt(bandBegin - k, 0);
+    int last = minInt(bandEnd + k, width);
+    // Row x is stored in row x - first + 1 of each buffer.  Offsetting the
+    // base pointers lets the kernels use the normal grid layout.
+    int16_t *grids[2];
+    for (int b=0 ; b<2 ; b++) {
+      grids[b] = buffers[b] - first * stride;
+      // If the band touches the edge of the grid, the rows just outside it
+      // are the grid's halo, which must be zero.
+      memset(buffers[b], 0, stride * sizeof(int16_t));
+      memset(&buffers[b][(last - first + 1) * stride], 0,
+             stride * sizeof(int16_t));
+    }
+    memcpy(&buffers[0][stride], &step->oldgrid[gridIndex(first, -1, height)],
+           (last - first) * stride * sizeof(int16_t));
+    for (int g=1 ; g<=k ; g++) {
+      int from = maxInt(bandBegin - k + g, 0);
+      int to = minInt(bandEnd + k - g, width);
+      step->fn(step->program, grids[(g - 1) & 1], grids[g & 1], width, height,
+               from, to, 0, height);
+    }
+    memcpy(&step->newgrid[gridIndex(bandBegin, -1, height)],
+           &grids[k & 1][gridIndex(bandBegin, -1, height)],
+           (bandEnd - bandBegin) * stride * sizeof(int16_t));
+  }
+  free(buffers[0]);
+  free(buffers[1]);
+}
+
+void runBlocked(int16_t *oldgrid, int16_t *newgrid, int16_t width,
+                int16_t height, int generations, kernelFn fn, void *program,
+                struct threadPool *pool)
+{
+  int stride = gridStride(height);
+  // Make the bands as large as will fit in the cache, but always at least as
+  // large as the halo, so that the redundant work doesn't dominate.
+  int bandRows = CacheBytes / (2 * stride * (int)sizeof(int16_t)) -
+                 2 * generations - 2;
+  bandRows = maxInt(bandRows, maxInt(2 * generations, 1));
+  struct blockedStep step = { oldgrid, newgrid, width, height, generations,
+                              bandRows, fn, program };
+  runInBands(pool, width, runBlockedRows, &step);
+}
@@ -0,0 +1,404 @@
+#include "interpreter.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// The closure compiler.  This turns each AST node into a closure: a pointer
+// to a C function that implements exactly that kind of node, with its
+// operands already decoded.  Running the program is then just a matter of
+// calling the function pointers, with no switch on the node type and no
+// decoding of tagged values.  Building the closures is much cheaper than
+// compiling with LLVM, so this is a good choice for short runs.
+
+struct closure;
+
+// The function implementing a closure.  Expressions return their value,
+// statements return 0.
+typedef int (*closureFn)(const struct closure *c,
+                         struct InterpreterState *state);
+
+struct closure {
+  // The implementation
+  closureFn fn;
+  // The destination register slot (or the key for range maps)
+  int16_t reg;
+  // The source register slot
+  int16_t src;
+  // An immediate value
+  int32_t imm;
+  // The number of children
+  int count;
+  // The children: the right-hand side of an operation, the arms of a range
+  // map or the body of a neighbours loop.
+  const struct closure **children;
+  // The preprocessed lookup for a range map
+  const struct rangeLookup *lookup;
+};
+
+// A complete program
+struct closures {
+  uintptr_t count;
+  const struct closure **list;
+  // The local register slots that must be zeroed before each cell
+  int zeroCount;
+  int16_t zero[10];
+};
+
+static int constant(const struct closure *c, struct InterpreterState *state) {
+  return c->imm;
+}
+
+static int load(const struct closure *c, struct InterpreterState *state) {
+  return state->reg[c->src];
+}
+
+static int rangeTable(const struct closure *c, struct InterpreterState *state) {
+  int arm = rangeTableLookup(c->lookup, state->reg[c->reg]);
+  return (arm < 0) ? 0 : c->children[arm]->fn(c->children[arm], state);
+}
+
+static int rangeBinarySearch(const struct closure *c, struct InterpreterState *state) {
+  int arm = rangeSearch(c->lookup, state->reg[c->reg]);
+  return (arm < 0) ? 0 : c->children[arm]->fn(c->children[arm], state);
+}
+
+static int neighbours(const struct closure *c, struct InterpreterState *state) {
+  const struct neighbourhood *n = state->neighbourhood;
+  for (int i=0 ; i<n->count ; i++) {
+    for (int j=0 ; j<c->count ; j++) {
+      state->reg[SlotA] = state->cell[n->offsets[i]];
+      c->children[j]->fn(c->children[j], state);
+    }
+    // If the last statement of the body did nothing, a0 is still loaded
+    // before it.
+    if (c->imm) {
+      state->reg[SlotA] = state->cell[n->offsets[i]];
+    }
+  }
+  return 0;
+}
+
+// Runs each statement in the body of an NTReductions node once.  Each one
+// visits all of the neighbours itself.
+static int reductions(const struct closure *c, struct InterpreterState *state) {
+  for (int j=0 ; j<c->count ; j++) {
+    c->children[j]->fn(c->children[j], state);
+  }
+  return 0;
+}
+
+#define REDUCE(name, combine) \
+  static int name(const struct closure *c, struct InterpreterState *state) {\
+    const struct neighbourhood *n = state->neighbourhood;\
+    int acc = state->reg[c->reg];\
+    for (int i=0 ; i<n->count ; i++) {\
+      int nv = state->cell[n->offsets[i]];\
+      acc = (combine);\
+    }\
+    state->reg[c->reg] = acc;\
+    return 0;\
+  }
+REDUCE(reduceSum, acc + nv)
+REDUCE(reduceMin, (nv > acc) ? acc : nv)
+REDUCE(reduceMax, (nv < acc) ? acc : nv)
+#undef REDUCE
+
+static int reduceCount(const struct closure *c, struct InterpreterState *state) {
+  state->reg[c->reg] += c->imm * state->neighbourhood->count;
+  return 0;
+}
+
+// Counts neighbours with a range map.  The arms are all constants.
+static int reduceMap(const struct closure *c, struct InterpreterState *state) {
+  const struct neighbourhood *n = state->neighbourhood;
+  int acc = state->reg[c->reg];
+  for (int i=0 ; i<n->count ; i++) {
+    int arm = findArm(c->lookup, state->cell[n->offsets[i]]);
+    acc += (arm < 0) ? 0 : c->children[arm]->imm;
+  }
+  state->reg[c->reg] = acc;
+  return 0;
+}
+
+// Each arithmetic operation has three implementations, for register (R),
+// immediate (I) and expression (E) right-hand sides.
+#define ARITHMETIC(name, expr) \
+  static int name##R(const struct closure *c, struct InterpreterState *state) {\
+    int l = state->reg[c->reg], rv = state->reg[c->src];\
+    state->reg[c->reg] = (expr);\
+    return 0;\
+  }\
+  static int name##I(const struct closure *c, struct InterpreterState *state) {\
+    int l = state->reg[c->reg], rv = c->imm;\
+    state->reg[c->reg] = (expr);\
+    return 0;\
+  }\
+  static int name##E(const struct closure *c, struct InterpreterState *state) {\
+    int l = state->reg[c->reg], rv = c->children[0]->fn(c->children[0], state);\
+    state->reg[c->reg] = (expr);\
+    return 0;\
+  }
+ARITHMETIC(add, l + rv)
+ARITHMETIC(sub, l - rv)
+ARITHMETIC(mul, l * rv)
+ARITHMETIC(div, l / rv)
+ARITHMETIC(assign, ((void)l, rv))
+ARITHMETIC(min, (rv > l) ? l : rv)
+ARITHMETIC(max, (rv < l) ? l : rv)
+#undef ARITHMETIC
+
+// Shifts, which always have an immediate right-hand side.  Right shifts round
+// towards zero.
+static int shl(const struct closure *c, struct InterpreterState *state) {
+  state->reg[c->reg] = (int)((unsigned)state->reg[c->reg] << c->imm);
+  return 0;
+}
+
+static int shr(const struct closure *c, struct InterpreterState *state) {
+  int l = state->reg[c->reg];
+  state->reg[c->reg] = (l + ((l >> 31) & ((1 << c->imm) - 1))) >> c->imm;
+  return 0;
+}
+
+static struct closure *newClosure(closureFn fn) {
+  struct closure *c = calloc(1, sizeof(struct closure));
+  c->fn = fn;
+  return c;
+}
+
+static const struct closure *compileStatement(struct ASTNode *ast);
+
+// Builds the closure for an expression: a register, a literal or a range map.
+static const struct closure *compileExpression(uintptr_t val) {
+  if ((val & 3) == 3) {
+    int slot = readSlot(val);
+    // Undefined registers always read as -1
+    if (slot < 0) {
+      struct closure *c = newClosure(constant);
+      c->imm = -1;
+      return c;
+    }
+    struct closure *c = newClosure(load);
+    c->src = slot;
+    return c;
+  }
+  if (val & 1) {
+    struct closure *c = newClosure(constant);
+    c->imm = (int)(val >> 2);
+    return c;
+  }
+  return compileStatement((struct ASTNode*)val);
+}
+
+static const struct closure *compileStatement(struct ASTNode *ast) {
+  switch (ast->type) {
+    case NTNeighbours: {
+      struct closure *c = newClosure(neighbours);
+      struct ASTNode **list = (struct ASTNode**)ast->val[1];
+      c->children = calloc(ast->val[0], sizeof(struct closure*));
+      for (int i=0 ; i<ast->val[0] ; i++) {
+        c->imm = 1;
+        // Literals and registers are valid statements, but do nothing.
+        if ((uintptr_t)list[i] & 1) continue;
+        const struct closure *statement = compileStatement(list[i]);
+        if (statement) {
+          c->children[c->count++] = statement;
+          c->imm = 0;
+        }
+      }
+      return c;
+    }
+    case NTRangeMap: {
+      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
+      struct rangeLookup *lookup = buildRangeLookup(rm);
+      struct closure *c =
+        newClosure(lookup->table ? rangeTable : rangeBinarySearch);
+      int slot = readSlot(rm->value);
+      assert(((rm->value & 3) == 3) && (slot >= 0) &&
+          "Range maps must map a register");
+      c->reg = slot;
+      c->lookup = lookup;
+      c->children = calloc(rm->count, sizeof(struct closure*));
+      for (int i=0 ; i<rm->count ; i++) {
+        c->children[i] = compileExpression(rm->entries[i].val);
+      }
+      c->count = rm->count;
+      return c;
+    }
+    case NTReductions: {
+      struct closure *c = newClosure(reductions);
+      struct ASTNode **list = (struct ASTNode**)ast->val[1];
+      c->children = calloc(ast->val[0], sizeof(struct closure*));
+      for (int i=0 ; i<ast->val[0] ; i++) {
+        c->children[c->count++] = compileStatement(list[i]);
+      }
+      return c;
+    }
+    case NTReduceSum:
+    case NTReduceMin:
+    case NTReduceMax:
+    case NTReduceCount: {
+      static const closureFn ops[] = {
+        [NTReduceSum] = reduceSum,
+        [NTReduceMin] = reduceMin,
+        [NTReduceMax] = reduceMax
+      };
+      uintptr_t arg = ast->val[1];
+      struct closure *c;
+      if (ast->type != NTReduceCount) {
+        c = newClosure(ops[ast->type]);
+      } else if (arg & 1) {
+        c = newClosure(reduceCount);
+        c->imm = (int)(arg >> 2);
+      } else {
+        struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)arg)->val[0];
+        c = newClosure(reduceMap);
+        c->lookup = buildRangeLookup(rm);
+        c->children = calloc(rm->count, sizeof(struct closure*));
+        for (int i=0 ; i<rm->count ; i++) {
+          c->children[i] = compileExpression(rm->entries[i].val);
+        }
+        c->count = rm->count;
+      }
+      c->reg = writeSlot(ast->val[0]);
+      return c;
+    }
+    case NTOperatorShl:
+    case NTOperatorShr: {
+      int slot = writeSlot(ast->val[0]);
+      if (slot < 0) {
+        return NULL;
+      }
+      struct closure *c = newClosure((ast->type == NTOperatorShl) ? shl : shr);
+      c->reg = slot;
+      c->imm = (int)(ast->val[1] >> 2);
+      return c;
+    }
+    case NTOperatorAdd:
+    case NTOperatorSub:
+    case NTOperatorMul:
+    case NTOperatorDiv:
+    case NTOperatorAssign:
+    case NTOperatorMin:
+    case NTOperatorMax: {
+      static const closureFn ops[][3] = {
+        [NTOperatorAdd] = { addR, addI, addE },
+        [NTOperatorSub] = { subR, subI, subE },
+        [NTOperatorMul] = { mulR, mulI, mulE },
+        [NTOperatorDiv] = { divR, divI, divE },
+        [NTOperatorAssign] = { assignR, assignI, assignE },
+        [NTOperatorMin] = { minR, minI, minE },
+        [NTOperatorMax] = { maxR, maxI, maxE }
+      };
+      // Writes to undefined registers are discarded, and expressions have
+      // no side effects, so the whole statement can be dropped.
+      int slot = writeSlot(ast->val[0]);
+      if (slot < 0) {
+        return NULL;
+      }
+      struct closure *c;
+      const struct closure *rhs = compileExpression(ast->val[1]);
+      if (rhs->fn == load) {
+        c = newClosure(ops[ast->type][0]);
+        c->src = rhs->src;
+      } else if (rhs->fn == constant) {
+        c = newClosure(ops[ast->type][1]);
+        c->imm = rhs->imm;
+      } else {
+        c = newClosure(ops[ast->type][2]);
+        c->children = calloc(1, sizeof(struct closure*));
+        c->children[0] = rhs;
+        c->count = 1;
+      }
+      c->reg = slot;
+      return c;
+    }
+  }
+  return 0;
+}
+
+struct closures *compileClosures(struct ASTNode **ast, uintptr_t count)
+{
+  struct closures *program = calloc(1, sizeof(struct closures));
+  program->list = calloc(count, sizeof(struct closure*));
+  uint16_t live = liveLocalRegisters(ast, count);
+  for (int i=0 ; i<10 ; i++) {
+    if (live & (1 << i)) {
+      program->zero[program->zeroCount++] = SlotA + i;
+    }
+  }
+  for (uintptr_t i=0 ; i<count ; i++) {
+    // Literals and registers are valid statements, but do nothing.
+    if ((uintptr_t)ast[i] & 1) continue;
+    const struct closure *statement = compileStatement(ast[i]);
+    if (statement) {
+      program->list[program->count++] = statement;
+    }
+  }
+  return program;
+}
+
+// The arguments for running the closures over a band of rows
+struct closureStep {
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+  struct closures *program;
+};
+
+// Runs the cells in rows [xBegin, xEnd) and columns [yBegin, yEnd) of a
+// single step.  Each call has its own interpreter state, so regions can run
+// concurrently.
+static void runRegion(void *context, int16_t xBegin, int16_t xEnd,
+                      int16_t yBegin, int16_t yEnd)
+{
+  struct closureStep *step = context;
+  struct InterpreterState state = {{0}};
+  struct neighbourhood neighbourhoods[16];
+  buildNeighbourhoods(neighbourhoods, step->height);
+  for (int x=xBegin ; x<xEnd ; x++) {
+    int i = gridIndex(x, yBegin, step->height);
+    for (int y=yBegin ; y<yEnd ; y++,i++) {
+      state.reg[SlotV] = step->oldgrid[i];
+      state.cell = &step->oldgrid[i];
+      state.neighbourhood =
+        &neighbourhoods[neighbourClass(x, y, step->width, step->height)];
+      for (int z=0 ; z<step->program->zeroCount ; z++) {
+        state.reg[step->program->zero[z]] = 0;
+      }
+      for (uintptr_t s=0 ; s<step->program->count ; s++) {
+        const struct closure *c = step->program->list[s];
+        c->fn(c, &state);
+      }
+      step->newgrid[i] = state.reg[SlotV];
+    }
+  }
+}
+
+// Runs a single step of the cells in a region, with the grids passed
+// directly.  This is a kernelFn, for executors that manage their own grids.
+void runClosureRegion(void *program, int16_t *oldgrid, int16_t *newgrid,
+        int16_t width, int16_t height, int16_t xBegin, int16_t xEnd,
+        int16_t yBegin, int16_t yEnd)
+{
+  struct closureStep step = { oldgrid, newgrid, width, height, program };
+  runRegion(&step, xBegin, xEnd, yBegin, yEnd);
+}
+
+static void runRows(void *context, int16_t rowBegin, int16_t rowEnd)
+{
+  struct closureStep *step = context;
+  runRegion(context, rowBegin, rowEnd, 0, step->height);
+}
+
+// Runs a single step using the closures, split across the threads in pool (if
+// any)
+void runClosureStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct closures *program, struct threadPool *pool, struct tileGrid *tiles)
+{
+  struct closureStep step = { oldgrid, newgrid, width, height, program };
+  if (tiles) {
+    runTiles(tiles, oldgrid, newgrid, runRegion, &step, pool);
+  } else {
+    runInBands(pool, width, runRows, &step);
+  }
+}
@@ -5,6 +5,8 @@
 #include <llvm/Linker.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/JIT.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Module.h>
@@ -15,20 +17,113 @@
 #include <llvm/Support/MemoryBuffer.h>
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include <llvm/IR/DataLayout.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Target/TargetMachine.h>
 #include <llvm/Support/system_error.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+#include <algorithm>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
 
 
 #include "AST.h"
 
 using namespace llvm;
 
+// The directory that compiled objects are cached in, or NULL if they aren't
+static const char *cacheDirectory;
+// The version of the code that this file generates, which is part of the
+// name of every cached object.  Bump it whenever the generated code changes.
+static const uint32_t CodegenVersion = 1;
+
+// A compiler holds everything that doesn't depend on the program, so that it
+// is only worked out once however many programs are compiled.  Each compiled
+// automaton has an LLVM context of its own, which is freed with it, so
+// compilers on different threads never share any IR, and the types that
+// each compile creates don't pile up in a context that outlives them.
+struct jitCompiler {
+  // The bitcode for the runtime helper code, which each compile parses into
+  // its own context
+  OwningPtr<MemoryBuffer> runtime;
+  // The CPU that this machine has, which JIT-compiled code is generated for
+  std::string cpu;
+  // The start of the cache key of everything that this compiler generates,
+  // covering the runtime, the code generator and the CPU
+  uint64_t cacheKey;
+};
+
 namespace {
+  // A cache of compiled objects on disk.  Each object is stored in a file
+  // named after a hash of everything that went into generating it, so an
+  // entry never needs to be invalidated: a different program, runtime, code
+  // generator, optimisation level or CPU just gives a different name.
+  class DiskObjectCache : public ObjectCache {
+    // The file that this module's object is stored in
+    std::string path;
+    // The object loaded from the file, if there was one
+    OwningPtr<MemoryBuffer> object;
+    public:
+    DiskObjectCache(uint64_t key) {
+      char name[32];
+      snprintf(name, sizeof(name), "/%016llx.o", (unsigned long long)key);
+      path = std::string(cacheDirectory) + name;
+      MemoryBuffer::getFile(path, object);
+    }
+    // Returns whether the object was found in the cache.
+    bool hasObject() {
+      return object.get() != 0;
+    }
+    virtual void notifyObjectCompiled(const Module *M,
+                                      const MemoryBuffer *Obj) {
+      // Several threads or processes may be compiling the same program at
+      // once, so the object is written to a uniquely named temporary file
+      // and then renamed, which never leaves a partial object in the cache.
+      mkdir(cacheDirectory, 0777);
+      std::vector<char> temporary(path.begin(), path.end());
+      const char suffix[] = ".XXXXXX";
+      temporary.insert(temporary.end(), suffix, suffix + sizeof(suffix));
+      int fd = mkstemp(&temporary[0]);
+      if (fd < 0) {
+        return;
+      }
+      // mkstemp() creates files that only their owner can read
+      fchmod(fd, 0644);
+      FILE *f = fdopen(fd, "wb");
+      if (!f) {
+        close(fd);
+        unlink(&temporary[0]);
+        return;
+      }
+      bool written = fwrite(Obj->getBufferStart(), 1, Obj->getBufferSize(), f)
+                     == Obj->getBufferSize();
+      if ((fclose(f) != 0) || !written ||
+          (rename(&temporary[0], path.c_str()) != 0)) {
+        unlink(&temporary[0]);
+      }
+    }
+    protected:
+    virtual const MemoryBuffer *getObject(const Module *M) {
+      return object.get();
+    }
+  };
+
   class CellularAutomatonCompiler {
     // LLVM uses a context object to allow multiple threads
     LLVMContext &C;
     // The compilation unit that we are generating
     Module *Mod;
+    // The execution engine, once one has been created.  This owns the module.
+    ExecutionEngine *engine;
     // The function representing the program
     Function *F;
     // A helper class for generating instructions
@@ -51,8 +146,28 @@ namespace {
     Value *y;
     // The value of the current cell (passed as an argument, returned at the end)
     Value *v;
+    // A pointer to the current cell in the input grid (passed as an argument)
+    Value *here;
+    // The offsets of the valid neighbours from here (passed as an argument)
+    Value *neighbourOffsets;
+    // The number of valid neighbours (passed as an argument)
+    Value *neighbourCount;
+    // The distance between rows in the grid (passed as an argument to the
+    // interior version)
+    Value *stride;
+    // The sum of the neighbours (passed as an argument to the interior
+    // version, if the program asks for it)
+    Value *neighbourSum;
+    // Whether we are generating the version for interior cells
+    bool interior;
     // The type of our registers (currently i16)
     Type *regTy;
+    // A hash of everything that the generated code depends on, used to name
+    // cached objects
+    uint64_t cacheKey;
+    // The cache that the object for this module is looked up in, if caching
+    // is enabled
+    OwningPtr<DiskObjectCache> cache;
     // Stores a value in the specified register.
     void storeInLValue(uintptr_t reg, Value *val) {
       reg >>= 2;
@@ -90,6 +205,208 @@ namespace {
       return emitStatement((struct ASTNode*)val);
     }
 
+    // A range map entry, with its bounds decoded.
+    struct RangeArm {
+      int min;
+      int max;
+      uintptr_t val;
+    };
+
+    // Range maps with up to this many arms are lowered to a chain of selects
+    // if their arms are all constants or registers.
+    static const int SelectChainLimit = 8;
+    // Range maps with constant arms are lowered to a lookup table if the keys
+    // that they cover span at most this many values.
+    static const int LookupTableLimit = 1024;
+    // Range maps that cover at most this many values in total are lowered to
+    // a switch.
+    static const int SwitchLimit = 1024;
+
+    // Returns whether an AST-encoded value is a literal.
+    static bool isLiteral(uintptr_t val) {
+      return (val & 3) == 1;
+    }
+
+    // Returns whether an AST-encoded value is a literal or a register, and
+    // can therefore be evaluated unconditionally.
+    static bool isSimple(uintptr_t val) {
+      return (val & 1) == 1;
+    }
+
+    // Emits a test for whether reg falls within the range covered by arm.
+    Value *emitArmMatch(Value *reg, const RangeArm &arm) {
+      // If the min and max values are the same, then we just need an
+      // equals-comparison
+      if (arm.min == arm.max) {
+        return B.CreateICmpEQ(reg, ConstantInt::get(regTy, arm.min, true));
+      }
+      // Otherwise we need to emit both values and then compare if we're
+      // greater-than-or-equal-to the smaller, and less-than-or-equal-to the
+      // larger.
+      Value *min = ConstantInt::get(regTy, arm.min, true);
+      Value *max = ConstantInt::get(regTy, arm.max, true);
+      return B.CreateAnd(B.CreateICmpSGE(reg, min), B.CreateICmpSLE(reg, max));
+    }
+
+    // Emits a range map.  Range maps are ordered, so the first arm that
+    // matches wins, and the result is 0 if none do.  The generic lowering is
+    // a chain of tests and branches, one per arm, but that puts unpredictable
+    // branches in the middle of the inner loop, so cheaper forms are used
+    // where the shape of the map allows.
+    Value *emitRangeMap(struct RangeMap *rm) {
+      // Load the register that we're mapping
+      Value *reg = getRValue(rm->value);
+      // Decode the arms, dropping any that can never match a 16-bit register.
+      std::vector<RangeArm> arms;
+      bool allLiterals = true;
+      bool allSimple = true;
+      int64_t lowest = INT16_MAX, highest = INT16_MIN, covered = 0;
+      for (int i=0 ; i<rm->count ; i++) {
+        struct RangeMapEntry *re = &rm->entries[i];
+        intptr_t min = re->min >> 2;
+        intptr_t max = re->max >> 2;
+        if ((min > INT16_MAX) || (min > max)) continue;
+        if (max > INT16_MAX) max = INT16_MAX;
+        RangeArm arm = { (int)min, (int)max, (uintptr_t)re->val };
+        arms.push_back(arm);
+        allLiterals &= isLiteral(arm.val);
+        allSimple &= isSimple(arm.val);
+        lowest = std::min<int64_t>(lowest, min);
+        highest = std::max<int64_t>(highest, max);
+        covered += max - min + 1;
+      }
+      if (arms.empty()) {
+        return ConstantInt::get(regTy, 0);
+      }
+      if (allSimple && ((int)arms.size() <= SelectChainLimit)) {
+        return emitRangeSelects(reg, arms);
+      }
+      if (allLiterals && (highest - lowest < LookupTableLimit)) {
+        return emitRangeTable(reg, arms, lowest, highest);
+      }
+      if (covered <= SwitchLimit) {
+        return emitRangeSwitch(reg, arms);
+      }
+      return emitRangeBranches(reg, arms);
+    }
+
+    // Lowers a range map whose arms have no side effects to a chain of
+    // selects.  The chain is built from the last arm backwards, so that
+    // earlier arms take priority.
+    Value *emitRangeSelects(Value *reg, const std::vector<RangeArm> &arms) {
+      Value *result = ConstantInt::get(regTy, 0);
+      for (int i=arms.size()-1 ; i>=0 ; i--) {
+        Value *match = emitArmMatch(reg, arms[i]);
+        result = B.CreateSelect(match, getRValue(arms[i].val), result);
+      }
+      return result;
+    }
+
+    // Lowers a range map with constant arms to a load from a constant table
+    // covering [lowest, highest].  Keys outside of that range load from a
+    // valid index and then have their result replaced with 0, so there are
+    // no branches.
+    Value *emitRangeTable(Value *reg, const std::vector<RangeArm> &arms,
+                          int lowest, int highest) {
+      int size = highest - lowest + 1;
+      std::vector<Constant*> values(size, ConstantInt::get(regTy, 0));
+      for (int i=arms.size()-1 ; i>=0 ; i--) {
+        Constant *val = ConstantInt::get(regTy, (int)(arms[i].val >> 2), true);
+        for (int key=arms[i].min ; key<=arms[i].max ; key++) {
+          values[key - lowest] = val;
+        }
+      }
+      ArrayType *tableTy = ArrayType::get(regTy, size);
+      GlobalVariable *table = new GlobalVariable(*Mod, tableTy, true,
+          GlobalValue::PrivateLinkage, ConstantArray::get(tableTy, values),
+          "range_table");
+      Type *intTy = Type::getInt32Ty(C);
+      Value *index = B.CreateSub(B.CreateSExt(reg, intTy),
+          ConstantInt::get(intTy, lowest, true));
+      // An unsigned comparison catches keys on both sides of the table.
+      Value *inRange = B.CreateICmpULT(index, ConstantInt::get(intTy, size));
+      index = B.CreateSelect(inRange, index, ConstantInt::get(intTy, 0));
+      Value *idxs[] = { ConstantInt::get(intTy, 0), index };
+      Value *val = B.CreateLoad(B.CreateInBoundsGEP(table, idxs));
+      return B.CreateSelect(inRange, val, ConstantInt::get(regTy, 0));
+    }
+
+    // Lowers a range map to a switch with a case for each value that it
+    // covers, with a PHI node in the continuation block collecting the
+    // result.
+    Value *emitRangeSwitch(Value *reg, const std::vector<RangeArm> &arms) {
+      BasicBlock *cont = BasicBlock::Create(C, "range_continue", F);
+      BasicBlock *none = BasicBlock::Create(C, "range_default", F);
+      PHINode *phi = PHINode::Create(regTy, arms.size() + 1, "range_result", cont);
+      SwitchInst *sw = B.CreateSwitch(reg, none, arms.size());
+      std::set<int> seen;
+      for (const RangeArm &arm : arms) {
+        BasicBlock *expr = BasicBlock::Create(C, "range_result", F);
+        bool reachable = false;
+        for (int key=arm.min ; key<=arm.max ; key++) {
+          // Keys claimed by an earlier arm stay with that arm.
+          if (seen.insert(key).second) {
+            sw->addCase(cast<ConstantInt>(ConstantInt::get(regTy, key, true)), expr);
+            reachable = true;
+          }
+        }
+        if (!reachable) {
+          expr->eraseFromParent();
+          continue;
+        }
+        B.SetInsertPoint(expr);
+        phi->addIncoming(getRValue(arm.val), B.GetInsertBlock());
+        B.CreateBr(cont);
+      }
+      B.SetInsertPoint(none);
+      B.CreateBr(cont);
+      phi->addIncoming(ConstantInt::get(regTy, 0), none);
+      B.SetInsertPoint(cont);
+      return phi;
+    }
+
+    // Lowers a range map to a chain of tests and branches, one per arm.
+    Value *emitRangeBranches(Value *reg, const std::vector<RangeArm> &arms) {
+      // Now create a basic block for continuation.  This is the block that
+      // will be reached after the range expression.
+      BasicBlock *cont = BasicBlock::Create(C, "range_continue", F);
+      // In this block, create a PHI node that contains the result.  
+      PHINode *phi = PHINode::Create(regTy, arms.size(), "range_result", cont);
+      // Now loop over all of the possible ranges and create a test for each one
+      BasicBlock *current= B.GetInsertBlock();
+      for (const RangeArm &arm : arms) {
+        // The match value is a boolean (i1) indicating whether the value
+        // matches this range.
+        Value *match = emitArmMatch(reg, arm);
+        // Create a pair of basic blocks, one for the case where we did match
+        // the specified range, and one for the case where we didn't.
+        BasicBlock *expr = BasicBlock::Create(C, "range_result", F);
+        BasicBlock *next = BasicBlock::Create(C, "range_next", F);
+        // Branch to the correct block
+        B.CreateCondBr(match, expr, next);
+        // Now construct the block for the case where we matched a value
+        B.SetInsertPoint(expr);
+        // getRValue() may emit some complex code, so we need to leave
+        // everything set up for it to (potentially) write lots of
+        // instructions and create more basic blocks (imagine nested range
+        // expressions).  If this is just a constant, then the next basic
+        // block will be empty, but the SimplifyCFG pass will remove it.
+        phi->addIncoming(getRValue(arm.val), B.GetInsertBlock());
+        // Now that we've generated the correct value, branch to the
+        // continuation block.
+        B.CreateBr(cont);
+        // ...and repeat
+        current = next;
+        B.SetInsertPoint(current);
+      }
+      // Branch to the continuation block if we've fallen off the end, and
+      // set the value to 0 for this case.
+      B.CreateBr(cont);
+      phi->addIncoming(ConstantInt::get(regTy, 0), current);
+      B.SetInsertPoint(cont);
+      return phi;
+    }
+
     // A helper function when debugging to allow you to print a register-sized
     // value.  This will print the string in the first argument, followed by
     // the value, and then a newline.  
@@ -118,21 +435,60 @@ namespace {
     }
 
     public:
-    CellularAutomatonCompiler() : C(getGlobalContext()), B(C){
-      // Load the bitcode for the runtime helper code
-      OwningPtr<MemoryBuffer> buffer;
-      MemoryBuffer::getFile("runtime.bc", buffer);
-      Mod = ParseBitcodeFile(buffer.get(), C);
+    CellularAutomatonCompiler(struct jitCompiler *jit, LLVMContext &context)
+      : C(context), engine(0), B(C), cacheKey(jit->cacheKey) {
+      // Load the runtime helper code into this context
+      Mod = ParseBitcodeFile(jit->runtime.get(), C);
+      // Cache the type of registers
+      regTy = Type::getInt16Ty(C);
+    }
+
+    // Removes a function from the runtime.  The runtime declares the stubs
+    // for both kinds of cell function, but only one of them is ever filled
+    // in, and the entry points that call the other one must be removed
+    // before the whole module is turned into an object.
+    void removeFunction(const char *name) {
+      Function *fn = Mod->getFunction(name);
+      if (fn) {
+        fn->replaceAllUsesWith(UndefValue::get(fn->getType()));
+        fn->eraseFromParent();
+      }
+    }
+
+    ~CellularAutomatonCompiler() {
+      if (!engine) {
+        delete Mod;
+      }
+    }
+
+    // Adds something that the generated code depends on to the cache key.
+    void addToCacheKey(const void *data, size_t length) {
+      cacheKey = fnvHash(cacheKey, data, length);
+    }
+
+    // Tells the runtime whether to pass interior cells their neighbours' sum.
+    void setSumNeighbours(bool sum) {
+      GlobalVariable *flag = Mod->getNamedGlobal("sumNeighbours");
+      flag->setInitializer(ConstantInt::get(Type::getInt32Ty(C), sum));
+      flag->setConstant(true);
+      flag->setLinkage(GlobalValue::InternalLinkage);
+    }
+
+    // Starts generating code for one of the cell function stubs in the
+    // runtime.  The border version is passed a list of neighbour offsets; the
+    // interior version is only called for cells that have all eight
+    // neighbours, and is passed the grid stride instead.
+    // liveRegisters is the mask of local registers that must start at zero.
+    void beginCell(const char *name, bool isInterior, uint16_t liveRegisters) {
+      interior = isInterior;
       // Get the stub (prototype) for the cell function
-      F = Mod->getFunction("cell");
+      F = Mod->getFunction(name);
       // Set it to have private linkage, so that it can be removed after being
       // inlined.
       F->setLinkage(GlobalValue::PrivateLinkage);
       // Add an entry basic block to this function and set it
       BasicBlock *entry = BasicBlock::Create(C, "entry", F);
       B.SetInsertPoint(entry);
-      // Cache the type of registers
-      regTy = Type::getInt16Ty(C);
 
       // Collect the function parameters
       auto args = F->arg_begin();
@@ -154,11 +510,28 @@ namespace {
       B.CreateStore(args++, v);
 
       // Create a load of pointers to the global registers.
-      Value *gArg = args;
+      Value *gArg = args++;
       for (int i=0 ; i<10 ; i++) {
-        B.CreateStore(ConstantInt::get(regTy, 0), a[i]);
+        if (liveRegisters & (1 << i)) {
+          B.CreateStore(ConstantInt::get(regTy, 0), a[i]);
+        }
         g[i] = B.CreateConstGEP1_32(gArg, i);
       }
+      here = args++;
+      if (interior) {
+        stride = args++;
+        neighbourSum = args++;
+      } else {
+        neighbourOffsets = args++;
+        neighbourCount = args++;
+      }
+    }
+
+    // Finishes the current cell function.
+    void endCell() {
+      // We've finished generating code, so add a return statement - we're
+      // returning the value  of the v register.
+      B.CreateRet(B.CreateLoad(v));
     }
 
     // Emits a statement or expression in the source language.  For
@@ -174,13 +547,21 @@ namespace {
         case ASTNode::NTOperatorDiv:
         case ASTNode::NTOperatorAssign:
         case ASTNode::NTOperatorMin:
-        case ASTNode::NTOperatorMax: {
+        case ASTNode::NTOperatorMax:
+        case ASTNode::NTOperatorShl:
+        case ASTNode::NTOperatorShr:
+        // In the generic neighbours loop, reductions are evaluated one
+        // neighbour at a time, like the equivalent arithmetic operation.
+        case ASTNode::NTReduceSum:
+        case ASTNode::NTReduceMin:
+        case ASTNode::NTReduceMax:
+        case ASTNode::NTReduceCount: {
           // Load the value from the register
           Value *reg = getRValue(ast->val[0]);
           // Evaluate the expression
           Value *expr = getRValue(ast->val[1]);
           // Now perform the operation
-          switch (ast->type) {
+          switch (arithmeticOperation(ast->type)) {
             // Simple arithmetic operations are single LLVM instructions
             case ASTNode::NTOperatorAdd:
               expr = B.CreateAdd(reg, expr);
@@ -207,122 +588,80 @@ namespace {
               expr = B.CreateSelect(gt, expr, reg);
               break;
             }
+            case ASTNode::NTOperatorShl:
+              expr = B.CreateShl(reg, expr);
+              break;
+            // Right shifts round towards zero, like division, so negative
+            // values have 2^n-1 added first.
+            case ASTNode::NTOperatorShr: {
+              int shift = ast->val[1] >> 2;
+              Value *sign = B.CreateAShr(reg, regTy->getPrimitiveSizeInBits() - 1);
+              Value *bias = B.CreateAnd(sign,
+                  ConstantInt::get(regTy, (1 << shift) - 1));
+              expr = B.CreateAShr(B.CreateAdd(reg, bias), expr);
+              break;
+            }
             default: break;
           }
           // Now store the result back in the register.
           storeInLValue(ast->val[0], expr);
           break;
         }
-        // Range expressions are more complicated.  They involve some flow
-        // control, because we select a different value.
-        case ASTNode::NTRangeMap: {
-          // Get the structure describing this node.
-          struct RangeMap *rm = (struct RangeMap*)ast->val[0];
-          // Load the register that we're mapping
-          Value *reg = getRValue(rm->value);
-          // Now create a basic block for continuation.  This is the block that
-          // will be reached after the range expression.
-          BasicBlock *cont = BasicBlock::Create(C, "range_continue", F);
-          // In this block, create a PHI node that contains the result.  
-          PHINode *phi = PHINode::Create(regTy, rm->count, "range_result", cont);
-          // Now loop over all of the possible ranges and create a test for each one
-          BasicBlock *current= B.GetInsertBlock();
-          for (int i=0 ; i<rm->count ; i++) {
-            struct RangeMapEntry *re = &rm->entries[i];
-            Value *match;
-            // If the min and max values are the same, then we just need an
-            // equals-comparison
-            if (re->min == re->max) {
-              Value *val = ConstantInt::get(regTy, (re->min >> 2));
-              match = B.CreateICmpEQ(reg, val);
-            } else {
-              // Otherwise we need to emit both calues and then compare if
-              // we're greater-than-or-equal-to the smaller, and
-              // less-than-or-equal-to the larger.
-              Value *min = ConstantInt::get(regTy, (re->min >> 2));
-              Value *max = ConstantInt::get(regTy, (re->max >> 2));
-              match = B.CreateAnd(B.CreateICmpSGE(reg, min), B.CreateICmpSLE(reg, max));
-            }
-            // The match value is now a boolean (i1) indicating whether the
-            // value matches this range.  Create a pair of basic blocks, one
-            // for the case where we did match the specified range, and one for
-            // the case where we didn't.
-            BasicBlock *expr = BasicBlock::Create(C, "range_result", F);
-            BasicBlock *next = BasicBlock::Create(C, "range_next", F);
-            // Branch to the correct block
-            B.CreateCondBr(match, expr, next);
-            // Now construct the block for the case where we matched a value
-            B.SetInsertPoint(expr);
-            // getRValue() may emit some complex code, so we need to leave
-            // everything set up for it to (potentially) write lots of
-            // instructions and create more basic blocks (imagine nested range
-            // expressions).  If this is just a constant, then the next basic
-            // block will be empty, but the SimplifyCFG pass will remove it.
-            phi->addIncoming(getRValue(re->val), B.GetInsertBlock());
-            // Now that we've generated the correct value, branch to the
-            // continuation block.
-            B.CreateBr(cont);
-            // ...and repeat
-            current = next;
-            B.SetInsertPoint(current);
+        // Range expressions are more complicated, see emitRangeMap().
+        case ASTNode::NTRangeMap:
+          return emitRangeMap((struct RangeMap*)ast->val[0]);
+        case ASTNode::NTReductions:
+          if (interior) {
+            emitInteriorReductions(ast);
+            break;
           }
-          // Branch to the continuation block if we've fallen off the end, and
-          // set the value to 0 for this case.
-          B.CreateBr(cont);
-          phi->addIncoming(ConstantInt::get(regTy, 0), current);
-          B.SetInsertPoint(cont);
-          return phi;
-        }
+          // Border cells use the generic loop
         case ASTNode::NTNeighbours: {
-          // For each of the (valid) neighbours
-          // Start by identifying the bounds
-          Value *XMin = B.CreateSub(x, ConstantInt::get(regTy, 1));
-          Value *XMax = B.CreateAdd(x, ConstantInt::get(regTy, 1));
-          Value *YMin = B.CreateSub(y, ConstantInt::get(regTy, 1));
-          Value *YMax = B.CreateAdd(y, ConstantInt::get(regTy, 1));
-          // Now clamp them to the grid
-          XMin = B.CreateSelect(B.CreateICmpSLT(XMin, ConstantInt::get(regTy, 0)), x, XMin);
-          YMin = B.CreateSelect(B.CreateICmpSLT(YMin, ConstantInt::get(regTy, 0)), y, YMin);
-          XMax = B.CreateSelect(B.CreateICmpSGE(XMax, width), x, XMax);
-          YMax = B.CreateSelect(B.CreateICmpSGE(YMax, height), y, YMax);
-
-          // Now create the loops
+          if (interior) {
+            // Interior cells have all eight neighbours, so fully unroll the
+            // loop.  The offsets are loop invariant, and the result is
+            // straight-line code that the loop vectoriser can handle.
+            Type *intTy = stride->getType();
+            for (int dx=-1 ; dx<=1 ; dx++) {
+              for (int dy=-1 ; dy<=1 ; dy++) {
+                if (dx == 0 && dy == 0) continue;
+                Value *offset = B.CreateAdd(
+                    B.CreateMul(stride, ConstantInt::get(intTy, dx, true)),
+                    ConstantInt::get(intTy, dy, true));
+                Value *neighbour = B.CreateGEP(here, offset);
+                for (int i=0 ; i<ast->val[0]; i++) {
+                  B.CreateStore(B.CreateLoad(neighbour), a[0]);
+                  emitAnyStatement(((struct ASTNode**)ast->val[1])[i]);
+                }
+              }
+            }
+            break;
+          }
+          // For each of the (valid) neighbours.  The runtime passes in the
+          // offsets of the neighbours that are inside the grid, so the loop
+          // doesn't need any bounds checks.
+          Type *intTy = neighbourCount->getType();
           BasicBlock *start = B.GetInsertBlock();
-          BasicBlock *xLoopStart = BasicBlock::Create(C, "x_loop_start", F);
-          BasicBlock *yLoopStart = BasicBlock::Create(C, "y_loop_start", F);
-          Value *I = B.CreateMul(XMin, width);
-          B.CreateBr(xLoopStart);
-          B.SetInsertPoint(xLoopStart);
-          PHINode *XPhi = B.CreatePHI(regTy, 2);
-          XPhi->addIncoming(XMin, start);
-          B.CreateBr(yLoopStart);
-          B.SetInsertPoint(yLoopStart);
-          PHINode *YPhi = B.CreatePHI(regTy, 2);
-          YPhi->addIncoming(YMin, xLoopStart);
-
-          BasicBlock *endY = BasicBlock::Create(C, "y_loop_end", F);
-          BasicBlock *body = BasicBlock::Create(C, "body", F);
-
-          B.CreateCondBr(B.CreateAnd(B.CreateICmpEQ(x, XPhi), B. CreateICmpEQ(y, YPhi)), endY, body);
+          BasicBlock *body = BasicBlock::Create(C, "neighbour_loop", F);
+          BasicBlock *cont = BasicBlock::Create(C, "continue", F);
+          B.CreateCondBr(B.CreateICmpSGT(neighbourCount,
+                ConstantInt::get(intTy, 0)), body, cont);
           B.SetInsertPoint(body);
-
+          PHINode *K = B.CreatePHI(intTy, 2);
+          K->addIncoming(ConstantInt::get(intTy, 0), start);
+          Value *offset = B.CreateLoad(B.CreateGEP(neighbourOffsets, K));
+          Value *neighbour = B.CreateGEP(here, offset);
 
           for (int i=0 ; i<ast->val[0]; i++) {
-            Value *idx = B.CreateAdd(YPhi, B.CreateMul(XPhi, width));
-            B.CreateStore(B.CreateLoad(B.CreateGEP(oldGrid, idx)), a[0]);
-            emitStatement(((struct ASTNode**)ast->val[1])[i]);
+            B.CreateStore(B.CreateLoad(neighbour), a[0]);
+            emitAnyStatement(((struct ASTNode**)ast->val[1])[i]);
           }
-          B.CreateBr(endY);
-          B.SetInsertPoint(endY);
-          BasicBlock *endX = BasicBlock::Create(C, "x_loop_end", F);
-          BasicBlock *cont = BasicBlock::Create(C, "continue", F);
-          // Increment the loop country for the next iteration
-          YPhi->addIncoming(B.CreateAdd(YPhi, ConstantInt::get(regTy, 1)), endY);
-          B.CreateCondBr(B.CreateICmpEQ(YPhi, YMax), endX, yLoopStart);
-
-          B.SetInsertPoint(endX);
-          XPhi->addIncoming(B.CreateAdd(XPhi, ConstantInt::get(regTy, 1)), endX);
-          B.CreateCondBr(B.CreateICmpEQ(XPhi, XMax), cont, xLoopStart);
+          // Increment the loop counter for the next iteration.  The body
+          // may have created new blocks, so the back edge comes from
+          // wherever we are now.
+          Value *next = B.CreateAdd(K, ConstantInt::get(intTy, 1));
+          K->addIncoming(next, B.GetInsertBlock());
+          B.CreateCondBr(B.CreateICmpSLT(next, neighbourCount), body, cont);
           B.SetInsertPoint(cont);
 
           break;
@@ -331,12 +670,233 @@ namespace {
       return 0;
     }
 
-    // Returns a function pointer for the automaton at the specified
-    // optimisation level.
-    automaton getAutomaton(int optimiseLevel) {
-      // We've finished generating code, so add a return statement - we're
-      // returning the value  of the v register.
-      B.CreateRet(B.CreateLoad(v));
+    // Returns the arithmetic operation that a reduction performs for each
+    // neighbour.
+    static int arithmeticOperation(int type) {
+      switch (type) {
+        case ASTNode::NTReduceSum:
+        case ASTNode::NTReduceCount:
+          return ASTNode::NTOperatorAdd;
+        case ASTNode::NTReduceMin:
+          return ASTNode::NTOperatorMin;
+        case ASTNode::NTReduceMax:
+          return ASTNode::NTOperatorMax;
+        default:
+          return type;
+      }
+    }
+
+    // Combines two values for a reduction.
+    Value *emitCombine(int type, Value *l, Value *r) {
+      switch (arithmeticOperation(type)) {
+        case ASTNode::NTOperatorMin:
+          return B.CreateSelect(B.CreateICmpSGT(r, l), l, r);
+        case ASTNode::NTOperatorMax:
+          return B.CreateSelect(B.CreateICmpSGT(r, l), r, l);
+        default:
+          return B.CreateAdd(l, r);
+      }
+    }
+
+    // Emits the reductions in an NTReductions node for an interior cell.
+    // Each neighbour is loaded once, and the values are combined in a
+    // balanced tree rather than a chain, so the additions (or comparisons)
+    // are independent of each other.
+    // Sums don't load the neighbours at all: the runtime keeps a sliding
+    // window of column sums and passes in the total.
+    void emitInteriorReductions(struct ASTNode *ast) {
+      Type *intTy = stride->getType();
+      struct ASTNode **list = (struct ASTNode**)ast->val[1];
+      bool needNeighbours = false;
+      for (int i=0 ; i<ast->val[0] ; i++) {
+        needNeighbours |= (list[i]->type != ASTNode::NTReduceSum);
+      }
+      Value *neighbours[8];
+      int count = 0;
+      for (int dx=-1 ; needNeighbours && (dx<=1) ; dx++) {
+        for (int dy=-1 ; dy<=1 ; dy++) {
+          if (dx == 0 && dy == 0) continue;
+          Value *offset = B.CreateAdd(
+              B.CreateMul(stride, ConstantInt::get(intTy, dx, true)),
+              ConstantInt::get(intTy, dy, true));
+          neighbours[count++] = B.CreateLoad(B.CreateGEP(here, offset));
+        }
+      }
+      for (int i=0 ; i<ast->val[0] ; i++) {
+        struct ASTNode *reduction = list[i];
+        if (reduction->type == ASTNode::NTReduceSum) {
+          Value *reg = getRValue(reduction->val[0]);
+          storeInLValue(reduction->val[0], B.CreateAdd(reg,
+                B.CreateTrunc(neighbourSum, regTy)));
+          continue;
+        }
+        std::vector<Value*> values;
+        for (int k=0 ; k<count ; k++) {
+          // Counts may be range maps over a0
+          B.CreateStore(neighbours[k], a[0]);
+          values.push_back(getRValue(reduction->val[1]));
+        }
+        while (values.size() > 1) {
+          std::vector<Value*> next;
+          for (unsigned k=0 ; k+1<values.size() ; k+=2) {
+            next.push_back(emitCombine(reduction->type, values[k], values[k+1]));
+          }
+          if (values.size() & 1) {
+            next.push_back(values.back());
+          }
+          values.swap(next);
+        }
+        Value *reg = getRValue(reduction->val[0]);
+        storeInLValue(reduction->val[0],
+            emitCombine(reduction->type, reg, values[0]));
+      }
+    }
+
+    // Emits a statement.  Literals and registers are valid statements, but
+    // don't do anything.
+    void emitAnyStatement(struct ASTNode *ast) {
+      if (!((uintptr_t)ast & 1)) {
+        emitStatement(ast);
+      }
+    }
+
+    // Adds three one-bit numbers in each bit position.  Returns the low bits
+    // of the sums and sets carry to the high bits.
+    Value *emitFullAdd(Value *a, Value *b, Value *c, Value *&carry) {
+      Value *t = B.CreateXor(a, b);
+      carry = B.CreateOr(B.CreateAnd(a, b), B.CreateAnd(t, c));
+      return B.CreateXor(t, c);
+    }
+
+    // Returns hi where x is 1 and lo where it is 0, in each bit position.
+    // Constant operands are folded here, so that the formula for a rule stays
+    // small even when it isn't optimised.
+    Value *emitBitSelect(Value *x, Value *hi, Value *lo) {
+      Type *ty = x->getType();
+      Value *zero = ConstantInt::get(ty, 0);
+      Value *ones = ConstantInt::getAllOnesValue(ty);
+      if (hi == lo) {
+        return hi;
+      }
+      if (hi == ones && lo == zero) {
+        return x;
+      }
+      if (hi == zero && lo == ones) {
+        return B.CreateNot(x);
+      }
+      if (hi == zero) {
+        return B.CreateAnd(B.CreateNot(x), lo);
+      }
+      if (lo == zero) {
+        return B.CreateAnd(x, hi);
+      }
+      if (hi == ones) {
+        return B.CreateOr(x, lo);
+      }
+      if (lo == ones) {
+        return B.CreateOr(B.CreateNot(x), hi);
+      }
+      return B.CreateOr(B.CreateAnd(x, hi), B.CreateAnd(B.CreateNot(x), lo));
+    }
+
+    // Emits a boolean function of five bit-sliced inputs, given as a truth
+    // table.  Bit i of table is the result when input k is bit (4-k) of i.
+    // Entries that aren't in care can never happen and can take either value.
+    // The function is built by splitting on one input at a time (starting
+    // with input first), stopping as soon as the remaining cases all agree.
+    Value *emitTruthTable(uint32_t table, uint32_t care, Value **inputs,
+                          int first) {
+      Type *ty = inputs[0]->getType();
+      if ((table & care) == 0) {
+        return ConstantInt::get(ty, 0);
+      }
+      if ((table & care) == care) {
+        return ConstantInt::getAllOnesValue(ty);
+      }
+      uint32_t set = 0;
+      for (int i=0 ; i<32 ; i++) {
+        if (i & (1 << (4 - first))) {
+          set |= 1U << i;
+        }
+      }
+      Value *hi = emitTruthTable(table, care & set, inputs, first + 1);
+      Value *lo = emitTruthTable(table, care & ~set, inputs, first + 1);
+      return emitBitSelect(inputs[first], hi, lo);
+    }
+
+    // Generates the bitCell() function for a two-state outer totalistic
+    // rule.  The neighbours are added with a network of full adders, giving
+    // the count in four bit-sliced words, and the rule becomes a boolean
+    // formula over those and the cell itself.
+    void emitBitCell(uint16_t born, uint16_t survive) {
+      F = Mod->getFunction("bitCell");
+      F->setLinkage(GlobalValue::PrivateLinkage);
+      BasicBlock *entry = BasicBlock::Create(C, "entry", F);
+      B.SetInsertPoint(entry);
+      Value *in[9];
+      auto args = F->arg_begin();
+      for (int i=0 ; i<9 ; i++) {
+        in[i] = args++;
+      }
+      // The arguments are the 3x3 block, with the cell itself in the middle
+      Value *cell = in[4];
+      Value *c1, *c2, *c3, *k1, *t1;
+      Value *s1 = emitFullAdd(in[0], in[1], in[2], c1);
+      Value *s2 = emitFullAdd(in[3], in[5], in[6], c2);
+      Value *s3 = B.CreateXor(in[7], in[8]);
+      c3 = B.CreateAnd(in[7], in[8]);
+      Value *bit0 = emitFullAdd(s1, s2, s3, k1);
+      // There are now four bits of weight two (c1, c2, c3 and k1)...
+      Value *t0 = emitFullAdd(c1, c2, c3, t1);
+      Value *bit1 = B.CreateXor(t0, k1);
+      Value *t2 = B.CreateAnd(t0, k1);
+      // ...and two of weight four, which can't add up to more than eight.
+      Value *bit2 = B.CreateXor(t1, t2);
+      Value *bit3 = B.CreateAnd(t1, t2);
+      // Counts of 9 to 15 are impossible, so they are don't-care entries.
+      uint32_t table = born | (survive << 16);
+      uint32_t care = 0x1ff | (0x1ff << 16);
+      Value *inputs[] = { cell, bit3, bit2, bit1, bit0 };
+      B.CreateRet(emitTruthTable(table, care, inputs, 0));
+    }
+
+    // Runs the optimisers over the module at the specified level and then
+    // creates an execution engine for it.  If objects are being cached, then
+    // the code is generated with MCJIT, and the optimisers are skipped if the
+    // object is already in the cache.
+    ExecutionEngine *getExecutionEngine(int optimiseLevel) {
+      if (cacheDirectory) {
+        addToCacheKey(&optimiseLevel, sizeof(optimiseLevel));
+        cache.reset(new DiskObjectCache(cacheKey));
+        if (!cache->hasObject()) {
+          optimiseModule(optimiseLevel);
+        }
+        std::string error;
+        ExecutionEngine *EE = EngineBuilder(Mod).setUseMCJIT(true)
+          .setErrorStr(&error).create();
+        if (!EE) {
+          fprintf(stderr, "Error: %s\n", error.c_str());
+          exit(-1);
+        }
+        EE->setObjectCache(cache.get());
+        engine = EE;
+        return EE;
+      }
+      optimiseModule(optimiseLevel);
+      // Now we are ready to generate some code.  First create the execution
+      // engine (JIT)
+      std::string error;
+      ExecutionEngine *EE = ExecutionEngine::create(Mod, false, &error);
+      if (!EE) {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        exit(-1);
+      }
+      engine = EE;
+      return EE;
+    }
+
+    // Runs the optimisers over the module at the specified level.
+    void optimiseModule(int optimiseLevel) {
 #ifdef DEBUG_CODEGEN
       // If we're debugging, then print the module in human-readable form to
       // the standard error and verify it.
@@ -371,33 +931,252 @@ namespace {
       PMBuilder.populateModulePassManager(*PerModulePasses);
       PerModulePasses->run(*Mod);
       delete PerModulePasses;
+    }
 
-      // Now we are ready to generate some code.  First create the execution
-      // engine (JIT)
+    // Adds a constant string to the module that a loader can look up by
+    // name.
+    void addString(const char *name, StringRef value) {
+      Constant *str = ConstantDataArray::getString(C, value);
+      new GlobalVariable(*Mod, str->getType(), true,
+          GlobalValue::ExternalLinkage, str, name);
+    }
+
+    // Optimises the module and writes it to a file as a native object for
+    // the specified CPU ("native" for this machine), which can be linked
+    // into a shared library and loaded without LLVM.  The object also
+    // exports the hash of the program as automatonProgramHash, and the CPU
+    // and features that it was generated for as automatonTargetCPU and
+    // automatonTargetFeatures, so that a loader can check what it was built
+    // from and whether it can run it.  Returns false on failure.
+    bool writeObject(int optimiseLevel, uint64_t programHash, const char *cpu,
+                     const char *filename) {
+      Type *hashTy = Type::getInt64Ty(C);
+      new GlobalVariable(*Mod, hashTy, true, GlobalValue::ExternalLinkage,
+          ConstantInt::get(hashTy, programHash), "automatonProgramHash");
+      std::string targetCPU = strcmp(cpu, "native") ? std::string(cpu) :
+                              sys::getHostCPUName();
+      std::string features = "";
+      addString("automatonTargetCPU", targetCPU);
+      addString("automatonTargetFeatures", features);
+      optimiseModule(optimiseLevel);
+      std::string triple = sys::getDefaultTargetTriple();
       std::string error;
-      ExecutionEngine *EE = ExecutionEngine::create(Mod, false, &error);
-      if (!EE) {
+      const Target *target = TargetRegistry::lookupTarget(triple, error);
+      if (!target) {
         fprintf(stderr, "Error: %s\n", error.c_str());
-        exit(-1);
+        return false;
+      }
+      // The object is going to end up in a shared library, so it must be
+      // position independent.
+      TargetOptions options;
+      OwningPtr<TargetMachine> TM(target->createTargetMachine(triple,
+          targetCPU, features, options, Reloc::PIC_,
+          CodeModel::Default, CodeGenOpt::Default));
+      std::string fileError;
+      tool_output_file out(filename, fileError, raw_fd_ostream::F_Binary);
+      if (!fileError.empty()) {
+        fprintf(stderr, "Error: %s\n", fileError.c_str());
+        return false;
+      }
+      PassManager PM;
+      PM.add(new DataLayout(*TM->getDataLayout()));
+      {
+        formatted_raw_ostream FOS(out.os());
+        if (TM->addPassesToEmitFile(PM, FOS, TargetMachine::CGFT_ObjectFile)) {
+          fprintf(stderr, "Error: can't generate objects for %s\n",
+                  triple.c_str());
+          return false;
+        }
+        PM.run(*Mod);
+      }
+      out.keep();
+      return true;
+    }
+
+    // Makes the code generated by the engine executable.  The engine
+    // outlives this compiler, so it must stop using the cache, which the
+    // compiler owns, once the object has been generated.
+    void finaliseEngine(ExecutionEngine *EE) {
+      // MCJIT doesn't make the code executable until it is finalised
+      EE->finalizeObject();
+      if (cache.get()) {
+        EE->setObjectCache(0);
       }
+    }
+
+    // Compiles the automaton at the specified optimisation level.  The
+    // returned automaton owns the execution engine, and with it the module
+    // and the machine code.
+    struct compiledAutomaton *getAutomaton(int optimiseLevel) {
+      ExecutionEngine *EE = getExecutionEngine(optimiseLevel);
+      struct compiledAutomaton *a = new compiledAutomaton();
+      a->engine = EE;
       // Now tell it to compile
-      return (automaton)EE->getPointerToFunction(Mod->getFunction("automaton"));
+      a->rows = (rowAutomaton)EE->getPointerToFunction(Mod->getFunction("automatonRows"));
+      a->region = (regionAutomaton)EE->getPointerToFunction(Mod->getFunction("automatonRegion"));
+      a->ca = (automaton)EE->getPointerToFunction(Mod->getFunction("automaton"));
+      finaliseEngine(EE);
+      return a;
+    }
+
+    // Compiles the bit-packed automaton at the specified optimisation level.
+    struct compiledAutomaton *getBitAutomaton(int optimiseLevel) {
+      ExecutionEngine *EE = getExecutionEngine(optimiseLevel);
+      struct compiledAutomaton *a = new compiledAutomaton();
+      a->engine = EE;
+      a->bits = (bitAutomaton)EE->getPointerToFunction(Mod->getFunction("bitAutomatonRows"));
+      finaliseEngine(EE);
+      return a;
     }
 
   };
 }
 
-extern "C"
-automaton compile(struct ASTNode **ast, uintptr_t count, int optimiseLevel) {
+// Returns whether a list of statements contains a reduction that adds up the
+// neighbours.
+static bool sumsNeighbours(uintptr_t *list, uintptr_t count) {
+  for (uintptr_t i=0 ; i<count ; i++) {
+    if (list[i] & 1) {
+      continue;
+    }
+    struct ASTNode *ast = (struct ASTNode*)list[i];
+    switch (ast->type) {
+      case ASTNode::NTReduceSum:
+        return true;
+      case ASTNode::NTNeighbours:
+      case ASTNode::NTReductions:
+        if (sumsNeighbours((uintptr_t*)ast->val[1], ast->val[0])) {
+          return true;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+// Generates the cell functions for a program.
+static void emitProgram(CellularAutomatonCompiler &compiler,
+                        struct ASTNode **ast, uintptr_t count) {
+  uint64_t program = hashProgram(ast, count);
+  compiler.addToCacheKey(&program, sizeof(program));
+  uint16_t live = liveLocalRegisters(ast, count);
+  compiler.setSumNeighbours(sumsNeighbours((uintptr_t*)ast, count));
+  // Generate the program twice: once for cells on the edges of the grid, and
+  // once, without any neighbour checks, for the interior.
+  const char *cells[] = { "cell", "cellInterior" };
+  for (int interior=0 ; interior<2 ; interior++) {
+    compiler.beginCell(cells[interior], interior, live);
+    // For each statement, generate some IR
+    for (int i=0 ; i<count ; i++) {
+      compiler.emitAnyStatement(ast[i]);
+    }
+    compiler.endCell();
+  }
+  compiler.removeFunction("bitAutomatonRows");
+  compiler.removeFunction("bitCell");
+}
+
+// Sets up the parts of LLVM that are shared by all compilers.
+static void initialiseLLVM() {
+  // The shared parts of LLVM need locking once there are several threads
+  llvm_start_multithreaded();
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
   // These functions do nothing, they just ensure that the correct modules are
   // not removed by the linker.
-  InitializeNativeTarget();
   LLVMLinkInJIT();
-  CellularAutomatonCompiler compiler;
-  // For each statement, generate some IR
-  for (int i=0 ; i<count ; i++) {
-    compiler.emitStatement(ast[i]);
+  LLVMLinkInMCJIT();
+}
+
+extern "C"
+struct jitCompiler *createJITCompiler(void) {
+  static pthread_once_t initialised = PTHREAD_ONCE_INIT;
+  pthread_once(&initialised, initialiseLLVM);
+  struct jitCompiler *c = new jitCompiler();
+  MemoryBuffer::getFile("runtime.bc", c->runtime);
+  c->cpu = sys::getHostCPUName();
+  // The generated code depends on the runtime, on this file and on the CPU,
+  // so a change to any of them must not reuse old objects.
+  c->cacheKey = fnvHash(FNVOffsetBasis, c->runtime->getBufferStart(),
+                        c->runtime->getBufferSize());
+  c->cacheKey = fnvHash(c->cacheKey, &CodegenVersion, sizeof(CodegenVersion));
+  c->cacheKey = fnvHash(c->cacheKey, c->cpu.data(), c->cpu.size());
+  return c;
+}
+
+extern "C"
+void destroyJITCompiler(struct jitCompiler *c) {
+  delete c;
+}
+
+extern "C"
+void freeAutomaton(struct compiledAutomaton *a) {
+  if (a) {
+    // Deleting the engine frees the module and the machine code, which must
+    // happen before the context that their types live in goes away.
+    delete (ExecutionEngine*)a->engine;
+    delete (LLVMContext*)a->context;
+    delete a;
   }
+}
+
+extern "C"
+struct compiledAutomaton *compile(struct jitCompiler *c, struct ASTNode **ast,
+                                  uintptr_t count, int optimiseLevel) {
+  LLVMContext *context = new LLVMContext();
+  CellularAutomatonCompiler compiler(c, *context);
+  emitProgram(compiler, ast, count);
   // And then return the compiled version.
-  return compiler.getAutomaton(optimiseLevel);
+  struct compiledAutomaton *a = compiler.getAutomaton(optimiseLevel);
+  a->context = context;
+  return a;
+}
+
+extern "C"
+int compileToObject(struct jitCompiler *c, struct ASTNode **ast,
+                    uintptr_t count, int optimiseLevel, const char *cpu,
+                    const char *filename) {
+  // The compiler deletes the module, so it must go before the context
+  LLVMContext context;
+  CellularAutomatonCompiler compiler(c, context);
+  emitProgram(compiler, ast, count);
+  return compiler.writeObject(optimiseLevel, hashProgram(ast, count), cpu,
+                              filename) ? 0 : -1;
+}
+
+extern "C"
+const char *hostCPUName(void) {
+  static std::string name = sys::getHostCPUName();
+  return name.c_str();
+}
+
+extern "C"
+struct compiledAutomaton *compileBitAutomaton(struct jitCompiler *c,
+                                              uint16_t born, uint16_t survive,
+                                              int optimiseLevel) {
+  LLVMContext *context = new LLVMContext();
+  CellularAutomatonCompiler compiler(c, *context);
+  // Bit-packed rules are keyed by their rule rather than a program, with a
+  // tag so that they can never collide with a program.
+  const char tag[] = "bits";
+  compiler.addToCacheKey(tag, sizeof(tag));
+  compiler.addToCacheKey(&born, sizeof(born));
+  compiler.addToCacheKey(&survive, sizeof(survive));
+  compiler.setSumNeighbours(false);
+  compiler.emitBitCell(born, survive);
+  const char *unused[] = { "automaton", "automatonRows", "automatonRegion",
+                           "cell", "cellInterior" };
+  for (int i=0 ; i<5 ; i++) {
+    compiler.removeFunction(unused[i]);
+  }
+  struct compiledAutomaton *a = compiler.getBitAutomaton(optimiseLevel);
+  a->context = context;
+  return a;
+}
+
+extern "C"
+void setObjectCacheDirectory(const char *directory) {
+  cacheDirectory = directory;
 }
@@ -0,0 +1,185 @@
+#include "AST.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Choosing between the interpreter and the JIT.  Compiling costs a roughly
+// fixed amount of time, because most of the module is the runtime rather
+// than the program, and the compiled code then runs each operation faster
+// than the interpreter.  Whether that pays off depends on how much work the
+// run does, which is estimated from the size of the grid, the number of
+// generations and the size of the program.
+//
+// How fast each backend is depends on the machine, so the speeds and compile
+// times come from a per-host profile, which is measured once by running a
+// program in each backend.  Until then, some rough defaults are used.
+
+// The side of the grid used for calibration, which is large enough that the
+// per-generation overheads don't matter
+static const int CalibrationSize = 256;
+// The minimum time to spend running each backend when calibrating
+static const double CalibrationSeconds = 0.2;
+
+void defaultProfile(struct hostProfile *p) {
+  p->interpretSeconds = 5e-9;
+  p->compiledSeconds[0] = 1e-9;
+  p->compiledSeconds[1] = 3e-10;
+  p->compileSeconds[0] = 0.05;
+  p->compileSeconds[1] = 0.15;
+}
+
+// The names of the fields in the profile file, in the order that they are
+// written
+static const char *fieldNames[] = {
+  "interpret", "compiled0", "compiled2", "compile0", "compile2"
+};
+
+static double *profileFields(struct hostProfile *p, int i) {
+  double *fields[] = { &p->interpretSeconds, &p->compiledSeconds[0],
+    &p->compiledSeconds[1], &p->compileSeconds[0], &p->compileSeconds[1] };
+  return fields[i];
+}
+
+const char *profileFile(void) {
+  static char path[1024];
+  const char *home = getenv("HOME");
+  snprintf(path, sizeof(path), "%s/.cellatom-profile", home ? home : ".");
+  return path;
+}
+
+int readProfile(struct hostProfile *p, const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    return -1;
+  }
+  char name[64];
+  double value;
+  while (fscanf(f, "%63s %lf", name, &value) == 2) {
+    for (int i=0 ; i<5 ; i++) {
+      if (strcmp(name, fieldNames[i]) == 0) {
+        *profileFields(p, i) = value;
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+int writeProfile(struct hostProfile *p, const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    return -1;
+  }
+  for (int i=0 ; i<5 ; i++) {
+    fprintf(f, "%s %g\n", fieldNames[i], *profileFields(p, i));
+  }
+  return fclose(f);
+}
+
+static uintptr_t statementsCost(struct ASTNode **ast, uintptr_t count);
+
+// Estimates the number of operations needed to evaluate an AST-encoded value.
+// Registers and literals are operands of other operations, so they are free.
+static uintptr_t valueCost(uintptr_t val) {
+  if (val & 1) {
+    return 0;
+  }
+  struct ASTNode *ast = (struct ASTNode*)val;
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions:
+      // Each statement in the body runs once per neighbour, after loading it
+      return 8 * (1 + statementsCost((struct ASTNode**)ast->val[1],
+                                     ast->val[0]));
+    case NTRangeMap: {
+      // One comparison per arm, and then whichever arm is chosen
+      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
+      uintptr_t arm = 0;
+      for (int i=0 ; i<rm->count ; i++) {
+        uintptr_t c = valueCost(rm->entries[i].val);
+        arm = (c > arm) ? c : arm;
+      }
+      return valueCost(rm->value) + rm->count + arm;
+    }
+    default:
+      return 1 + valueCost(ast->val[1]);
+  }
+}
+
+static uintptr_t statementsCost(struct ASTNode **ast, uintptr_t count) {
+  uintptr_t cost = 0;
+  for (uintptr_t i=0 ; i<count ; i++) {
+    cost += valueCost((uintptr_t)ast[i]);
+  }
+  return cost;
+}
+
+uintptr_t programCost(struct ASTNode **ast, uintptr_t count) {
+  // Loading and storing the cell counts too
+  return 1 + statementsCost(ast, count);
+}
+
+int chooseBackend(struct hostProfile *p, double operations, int threads,
+                  double estimates[3])
+{
+  // Running is split between the threads, but compiling isn't
+  double work = operations / threads;
+  estimates[BackendInterpreter] = work * p->interpretSeconds;
+  estimates[BackendCompiled] = p->compileSeconds[0] +
+                               work * p->compiledSeconds[0];
+  estimates[BackendOptimised] = p->compileSeconds[1] +
+                                work * p->compiledSeconds[1];
+  int best = BackendInterpreter;
+  for (int i=1 ; i<3 ; i++) {
+    if (estimates[i] < estimates[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static double secondsSince(clock_t c) {
+  return ((double)clock() - (double)c) / (double)CLOCKS_PER_SEC;
+}
+
+void calibrateProfile(struct hostProfile *p, struct ASTNode **ast,
+                      uintptr_t count)
+{
+  int cells = gridCells(CalibrationSize, CalibrationSize);
+  int16_t *g1 = calloc(cells, sizeof(int16_t));
+  int16_t *g2 = calloc(cells, sizeof(int16_t));
+  for (int x=0 ; x<CalibrationSize ; x++) {
+    for (int y=0 ; y<CalibrationSize ; y++) {
+      g1[gridIndex(x, y, CalibrationSize)] = random() % 2;
+    }
+  }
+  double generationOps = (double)programCost(ast, count) *
+                         CalibrationSize * CalibrationSize;
+  struct bytecode *code = compileBytecode(ast, count);
+  int generations = 0;
+  clock_t c = clock();
+  do {
+    runOneStep(g1, g2, CalibrationSize, CalibrationSize, code, NULL, NULL);
+    generations++;
+  } while (secondsSince(c) < CalibrationSeconds);
+  p->interpretSeconds = secondsSince(c) / (generations * generationOps);
+  int levels[2] = { 0, OptimisedLevel };
+  struct jitCompiler *jit = createJITCompiler();
+  for (int l=0 ; l<2 ; l++) {
+    c = clock();
+    struct compiledAutomaton *a = compile(jit, ast, count, levels[l]);
+    p->compileSeconds[l] = secondsSince(c);
+    generations = 0;
+    c = clock();
+    do {
+      a->ca(g1, g2, CalibrationSize, CalibrationSize);
+      generations++;
+    } while (secondsSince(c) < CalibrationSeconds);
+    p->compiledSeconds[l] = secondsSince(c) / (generations * generationOps);
+    freeAutomaton(a);
+  }
+  destroyJITCompiler(jit);
+  free(g1);
+  free(g2);
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+
+// The layout of grids in memory, shared by the interpreters, main.c and the
+// JIT runtime.
+//
+// Grids are stored with a one-cell halo all of the way around, so every cell
+// has eight neighbours in memory and the neighbour loops never need to check
+// coordinates.  Halo cells are always zero and are never part of a cell's
+// neighbour set.  Row x holds the cells (x, 0) to (x, height-1), preceded and
+// followed by a halo cell.
+
+// The distance between the starts of two adjacent rows
+static inline int gridStride(int height) {
+  return height + 2;
+}
+
+// The index of the cell at (x, y)
+static inline int gridIndex(int x, int y, int height) {
+  return (x + 1) * gridStride(height) + y + 1;
+}
+
+// The number of cells to allocate, including the halo
+static inline int gridCells(int width, int height) {
+  return (width + 2) * gridStride(height);
+}
+
+// The neighbours of a cell that are inside the grid, as offsets from the cell
+// itself, in the order in which neighbours loops visit them.
+struct neighbourhood {
+  int count;
+  int offsets[8];
+};
+
+// Cells fall into 16 classes, depending on which edges of the grid they are
+// on.  Cells in the interior are class 0 and have all eight neighbours.
+static inline int neighbourClass(int x, int y, int width, int height) {
+  return (x == 0) | ((x == width - 1) << 1) | ((y == 0) << 2) |
+    ((y == height - 1) << 3);
+}
+
+// Fills in the neighbourhood for each class of cell.
+static inline void buildNeighbourhoods(struct neighbourhood n[16], int height) {
+  int stride = gridStride(height);
+  for (int c=0 ; c<16 ; c++) {
+    n[c].count = 0;
+    for (int dx=-1 ; dx<=1 ; dx++) {
+      if (((dx < 0) && (c & 1)) || ((dx > 0) && (c & 2))) continue;
+      for (int dy=-1 ; dy<=1 ; dy++) {
+        if (((dy < 0) && (c & 4)) || ((dy > 0) && (c & 8))) continue;
+        if (dx == 0 && dy == 0) continue;
+        n[c].offsets[n[c].count++] = dx * stride + dy;
+      }
+    }
+  }
+}
+
+// Grids of cells that can only be 0 or 1 can also be packed into bits, with
+// row x stored as bitRowWords(height) words and cell (x, y) in bit y%64 of word
+// y/64.  Bits past the end of a row are always zero, and there is a row of
+// zeroes before the first row and after the last one.
+
+static inline int bitRowWords(int height) {
+  return (height + 63) / 64;
+}
+
+// Word i of a row, shifted so that each bit holds its neighbour in column y-1
+static inline uint64_t bitWest(const uint64_t *row, int i) {
+  return (row[i] << 1) | (i > 0 ? row[i-1] >> 63 : 0);
+}
+
+// Word i of a row, shifted so that each bit holds its neighbour in column y+1
+static inline uint64_t bitEast(const uint64_t *row, int i, int words) {
+  return (row[i] >> 1) | (i + 1 < words ? row[i+1] << 63 : 0);
+}
@@ -0,0 +1,389 @@
+#include "AST.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A Hashlife engine.  The universe is a quadtree of canonical nodes: a node at
+// level k is a 2^k x 2^k block of cells, and two blocks with the same
+// contents are always the same node.  The result of running the centre of a
+// block forward is memoised on the node, so repeated structure (in space or
+// in time) is only ever computed once, and a level-k node can be advanced
+// 2^(k-2) generations in one step.
+//
+// The grid is finite, and cells outside of it are not neighbours of anything.
+// To embed it in the infinite plane that Hashlife works on, every cell outside
+// of the grid holds a wall state.  Walls never change and are skipped when
+// building a cell's neighbourhood, so the cells inside the grid see exactly the
+// same neighbours as they do in the other engines.
+//
+// The rule itself is evaluated by the bytecode interpreter, one cell at a
+// time, so this only works for programs that don't use the global registers.
+
+// The state of cells outside of the grid.  Real cells are 16-bit.
+enum { Wall = 0x10000 };
+
+// Children are stored in this order.  As elsewhere, x is the row and y the
+// column.
+enum { NW, NE, SW, SE };
+
+struct node {
+  // The node is a 2^level x 2^level block
+  int level;
+  // The cell's value, for level 0 nodes
+  int value;
+  struct node *child[4];
+  // The centre of the node, advanced 2^(level-2) generations
+  struct node *result;
+  // The centre of the node, advanced 2^steppedBy generations
+  struct node *stepped;
+  int steppedBy;
+  // The next node in the same hash bucket
+  struct node *next;
+};
+
+// Collect the garbage once the table holds this many nodes.  An advance that
+// takes the table past this is abandoned and retried in smaller steps, so
+// memory stays bounded however far the grid is advanced.
+static const size_t NodeLimit = 1 << 21;
+
+struct hashlife {
+  struct bytecode *code;
+  int16_t width;
+  int16_t height;
+  // The grid, at the top left of a node of this level, surrounded by walls
+  int level;
+  struct node *grid;
+  // The hash table of canonical nodes
+  struct node **buckets;
+  size_t bucketCount;
+  size_t nodeCount;
+  // The largest step, as a power of two, that is tried in one go.  This
+  // drops each time a step fills the table, so that the work done before
+  // giving up isn't repeated on every step.
+  int maxStep;
+  // A node full of walls for each level
+  struct node *walls[64];
+};
+
+static size_t hashNode(int level, int value, struct node *const *child) {
+  uintptr_t h = level * 31 + value;
+  for (int i=0 ; i<4 ; i++) {
+    h = (h * 1000003) ^ (uintptr_t)child[i];
+  }
+  return h ^ (h >> 17);
+}
+
+static void rehash(struct hashlife *h, size_t bucketCount) {
+  struct node **buckets = calloc(bucketCount, sizeof(struct node*));
+  for (size_t i=0 ; i<h->bucketCount ; i++) {
+    struct node *n = h->buckets[i];
+    while (n) {
+      struct node *next = n->next;
+      size_t b = hashNode(n->level, n->value, n->child) % bucketCount;
+      n->next = buckets[b];
+      buckets[b] = n;
+      n = next;
+    }
+  }
+  free(h->buckets);
+  h->buckets = buckets;
+  h->bucketCount = bucketCount;
+}
+
+// Returns the canonical node with the specified contents.
+static struct node *find(struct hashlife *h, int level, int value,
+                         struct node *nw, struct node *ne, struct node *sw,
+                         struct node *se)
+{
+  struct node *child[4] = { nw, ne, sw, se };
+  size_t b = hashNode(level, value, child) % h->bucketCount;
+  for (struct node *n=h->buckets[b] ; n ; n=n->next) {
+    if ((n->level == level) && (n->value == value) &&
+        (memcmp(n->child, child, sizeof(child)) == 0)) {
+      return n;
+    }
+  }
+  struct node *n = calloc(1, sizeof(struct node));
+  n->level = level;
+  n->value = value;
+  memcpy(n->child, child, sizeof(child));
+  n->next = h->buckets[b];
+  h->buckets[b] = n;
+  if (++h->nodeCount > h->bucketCount) {
+    rehash(h, h->bucketCount * 2);
+  }
+  return n;
+}
+
+static struct node *leaf(struct hashlife *h, int value) {
+  return find(h, 0, value, NULL, NULL, NULL, NULL);
+}
+
+static struct node *join(struct hashlife *h, struct node *nw, struct node *ne,
+                         struct node *sw, struct node *se)
+{
+  return find(h, nw->level + 1, 0, nw, ne, sw, se);
+}
+
+static struct node *wall(struct hashlife *h, int level) {
+  if (h->walls[level] == NULL) {
+    if (level == 0) {
+      h->walls[0] = leaf(h, Wall);
+    } else {
+      struct node *w = wall(h, level - 1);
+      h->walls[level] = join(h, w, w, w, w);
+    }
+  }
+  return h->walls[level];
+}
+
+// The node of the level below made from the centre of n
+static struct node *centre(struct hashlife *h, struct node *n) {
+  return join(h, n->child[NW]->child[SE], n->child[NE]->child[SW],
+              n->child[SW]->child[NE], n->child[SE]->child[NW]);
+}
+
+// The node of the level below straddling the boundary between w and e
+static struct node *horizontal(struct hashlife *h, struct node *w,
+                               struct node *e)
+{
+  return join(h, w->child[NE], e->child[NW], w->child[SE], e->child[SW]);
+}
+
+// The node of the level below straddling the boundary between n and s
+static struct node *vertical(struct hashlife *h, struct node *n,
+                             struct node *s)
+{
+  return join(h, n->child[SW], n->child[SE], s->child[NW], s->child[NE]);
+}
+
+// Runs the rule for the cell at (x, y) in a 4x4 block.
+static int evaluate(struct hashlife *h, int cells[4][4], int x, int y) {
+  if (cells[x][y] == Wall) {
+    return Wall;
+  }
+  // Copy the cell and its neighbours into a 3x3 grid, leaving out walls.
+  int16_t block[9] = {0};
+  struct neighbourhood n = { 0 };
+  for (int dx=-1 ; dx<=1 ; dx++) {
+    for (int dy=-1 ; dy<=1 ; dy++) {
+      int value = cells[x+dx][y+dy];
+      if (value == Wall) continue;
+      block[(dx+1) * 3 + dy + 1] = value;
+      if (dx == 0 && dy == 0) continue;
+      n.offsets[n.count++] = dx * 3 + dy;
+    }
+  }
+  return interpretCell(h->code, &block[4], &n);
+}
+
+// Advances the centre of a level 2 node by one generation.
+static struct node *stepLeaves(struct hashlife *h, struct node *n) {
+  int cells[4][4];
+  for (int x=0 ; x<4 ; x++) {
+    for (int y=0 ; y<4 ; y++) {
+      struct node *quadrant = n->child[(x >> 1) * 2 + (y >> 1)];
+      cells[x][y] = quadrant->child[(x & 1) * 2 + (y & 1)]->value;
+    }
+  }
+  return join(h, leaf(h, evaluate(h, cells, 1, 1)),
+              leaf(h, evaluate(h, cells, 1, 2)),
+              leaf(h, evaluate(h, cells, 2, 1)),
+              leaf(h, evaluate(h, cells, 2, 2)));
+}
+
+// Returns the centre of n (a node one level down) advanced 2^step
+// generations.  step can be at most n->level - 2.  Returns NULL if the table
+// grew past NodeLimit first, unless step is 0, which always finishes.
+static struct node *advance(struct hashlife *h, struct node *n, int step) {
+  int level = n->level;
+  int full = (step == level - 2);
+  if (full && n->result) {
+    return n->result;
+  }
+  if (!full && n->stepped && (n->steppedBy == step)) {
+    return n->stepped;
+  }
+  if ((step > 0) && (h->nodeCount > NodeLimit)) {
+    return NULL;
+  }
+  struct node *result;
+  if (level == 2) {
+    result = stepLeaves(h, n);
+  } else {
+    // Split the node into nine overlapping subnodes, one level down, and
+    // take their centres, two levels down.  A full step advances these by
+    // half of the total; otherwise only the second half moves forward.
+    struct node *sub[9] = {
+      n->child[NW], horizontal(h, n->child[NW], n->child[NE]), n->child[NE],
+      vertical(h, n->child[NW], n->child[SW]), centre(h, n),
+      vertical(h, n->child[NE], n->child[SE]),
+      n->child[SW], horizontal(h, n->child[SW], n->child[SE]), n->child[SE]
+    };
+    struct node *r[9];
+    for (int i=0 ; i<9 ; i++) {
+      r[i] = full ? advance(h, sub[i], level - 3) : centre(h, sub[i]);
+      if (!r[i]) {
+        return NULL;
+      }
+    }
+    int next = full ? level - 3 : step;
+    struct node *q[4] = {
+      join(h, r[0], r[1], r[3], r[4]), join(h, r[1], r[2], r[4], r[5]),
+      join(h, r[3], r[4], r[6], r[7]), join(h, r[4], r[5], r[7], r[8])
+    };
+    for (int i=0 ; i<4 ; i++) {
+      q[i] = advance(h, q[i], next);
+      if (!q[i]) {
+        return NULL;
+      }
+    }
+    result = join(h, q[0], q[1], q[2], q[3]);
+  }
+  if (full) {
+    n->result = result;
+  } else {
+    n->stepped = result;
+    n->steppedBy = step;
+  }
+  return result;
+}
+
+// Builds the node at the specified level whose top left cell is (x, y).
+static struct node *build(struct hashlife *h, int16_t *grid, int level, int x,
+                          int y)
+{
+  if (level == 0) {
+    if ((x >= h->width) || (y >= h->height)) {
+      return wall(h, 0);
+    }
+    return leaf(h, grid[gridIndex(x, y, h->height)]);
+  }
+  // Don't bother descending into blocks that are entirely outside the grid
+  if ((x >= h->width) || (y >= h->height)) {
+    return wall(h, level);
+  }
+  int half = 1 << (level - 1);
+  return join(h, build(h, grid, level - 1, x, y),
+              build(h, grid, level - 1, x, y + half),
+              build(h, grid, level - 1, x + half, y),
+              build(h, grid, level - 1, x + half, y + half));
+}
+
+// Copies the cells of n, whose top left cell is at (x, y), into the grid.
+static void flatten(struct hashlife *h, int16_t *grid, struct node *n, int x,
+                    int y)
+{
+  if ((x >= h->width) || (y >= h->height)) {
+    return;
+  }
+  if (n->level == 0) {
+    grid[gridIndex(x, y, h->height)] = n->value;
+    return;
+  }
+  int half = 1 << (n->level - 1);
+  flatten(h, grid, n->child[NW], x, y);
+  flatten(h, grid, n->child[NE], x, y + half);
+  flatten(h, grid, n->child[SW], x + half, y);
+  flatten(h, grid, n->child[SE], x + half, y + half);
+}
+
+// Throws away every node and memoised result, keeping only the grid.
+static void collectGarbage(struct hashlife *h) {
+  int16_t *grid = calloc(gridCells(h->width, h->height), sizeof(int16_t));
+  flatten(h, grid, h->grid, 0, 0);
+  for (size_t i=0 ; i<h->bucketCount ; i++) {
+    struct node *n = h->buckets[i];
+    while (n) {
+      struct node *next = n->next;
+      free(n);
+      n = next;
+    }
+    h->buckets[i] = NULL;
+  }
+  h->nodeCount = 0;
+  memset(h->walls, 0, sizeof(h->walls));
+  h->grid = build(h, grid, h->level, 0, 0);
+  free(grid);
+}
+
+struct hashlife *createHashlife(struct bytecode *code, int16_t *grid,
+                                int16_t width, int16_t height)
+{
+  struct hashlife *h = calloc(1, sizeof(struct hashlife));
+  h->code = code;
+  h->width = width;
+  h->height = height;
+  h->bucketCount = 1024;
+  h->buckets = calloc(h->bucketCount, sizeof(struct node*));
+  h->maxStep = 30;
+  while (((1 << h->level) < width) || ((1 << h->level) < height)) {
+    h->level++;
+  }
+  h->grid = build(h, grid, h->level, 0, 0);
+  return h;
+}
+
+// Advances the grid by 2^generations generations.  Returns 0, leaving the
+// grid unchanged, if the table filled up first.
+static int advanceGrid(struct hashlife *h, int generations) {
+  // The result of advancing a node is its centre, and nothing can travel
+  // more than one cell per generation, so the grid is surrounded by at
+  // least 2^generations cells of wall on every side.
+  int level = h->level + 1;
+  if (level < generations + 2) {
+    level = generations + 2;
+  }
+  struct node *region = h->grid;
+  while (region->level < level - 1) {
+    struct node *w = wall(h, region->level);
+    region = join(h, region, w, w, w);
+  }
+  struct node *w = wall(h, level - 2);
+  struct node *root = join(h,
+      join(h, w, w, w, region->child[NW]),
+      join(h, w, w, region->child[NE], w),
+      join(h, w, region->child[SW], w, w),
+      join(h, region->child[SE], w, w, w));
+  // The result is the same region, advanced, with the grid still at the top
+  // left.
+  struct node *result = advance(h, root, generations);
+  if (!result) {
+    return 0;
+  }
+  while (result->level > h->level) {
+    result = result->child[NW];
+  }
+  h->grid = result;
+  return 1;
+}
+
+// Advances the grid by 2^generations generations, in smaller steps if a
+// single one would need too many nodes.
+static void advanceGridBounded(struct hashlife *h, int generations) {
+  if (generations <= h->maxStep) {
+    if (h->nodeCount > NodeLimit) {
+      collectGarbage(h);
+    }
+    if (advanceGrid(h, generations)) {
+      return;
+    }
+    // Only the memoised results have changed, so throw them away and take
+    // two steps of half the size instead.
+    collectGarbage(h);
+    h->maxStep = generations - 1;
+  }
+  advanceGridBounded(h, generations - 1);
+  advanceGridBounded(h, generations - 1);
+}
+
+void runHashlife(struct hashlife *h, int generations) {
+  for (int i=30 ; i>=0 ; i--) {
+    if (generations & (1 << i)) {
+      advanceGridBounded(h, i);
+    }
+  }
+}
+
+void readHashlife(struct hashlife *h, int16_t *grid) {
+  flatten(h, grid, h->grid, 0, 0);
+}
@@ -1,115 +1,236 @@
-#include "AST.h"
+#include "interpreter.h"
+#include <assert.h>
+#include <stdlib.h>
 #include <strings.h> 
 #include <stdio.h> 
 
-// The current state for the interpreter
-struct InterpreterState {
-  // The local registers
-  int16_t a[10];
-  // The global registers
-  int16_t g[10];
-  // The current cell value
-  int16_t v;
-  // The width of the grid
-  int16_t width;
-  // The height of the grid
-  int16_t height;
-  // The x coordinate of the current cell
-  int16_t x;
-  // The y coordinate of the current cell
-  int16_t y;
-  // The grid itself
-  int16_t *grid;
+// The bytecode opcodes.  Every arithmetic operation comes in three forms,
+// depending on where the right-hand operand comes from: a register (R), an
+// immediate (I) or the accumulator (A), which holds the result of the most
+// recently evaluated range expression.
+enum opcode {
+  OpAddR, OpAddI, OpAddA,
+  OpSubR, OpSubI, OpSubA,
+  OpMulR, OpMulI, OpMulA,
+  OpDivR, OpDivI, OpDivA,
+  OpMovR, OpMovI, OpMovA,
+  OpMinR, OpMinI, OpMinA,
+  OpMaxR, OpMaxI, OpMaxA,
+  // Shift reg left, or right rounding towards zero, by imm
+  OpShl, OpShr,
+  // Load a register or an immediate into the accumulator
+  OpAccR, OpAccI,
+  // Range map, keyed on register reg, using the lookup code->ranges[imm].
+  // Followed by src OpRangeEntry instructions, one per arm of the original
+  // range map, each holding the arm's jump target in imm.  Falls through to
+  // the instruction after the entries if nothing matches.  OpRangeTable is
+  // used when the lookup has a direct table, OpRangeSearch otherwise.
+  OpRangeTable, OpRangeSearch, OpRangeEntry,
+  // Unconditional jump to imm
+  OpJump,
+  // Neighbour loops.  reg holds the nesting depth of the loop.  OpNeighbours
+  // starts the loop and jumps to imm if there are no neighbours,
+  // OpLoadNeighbour copies the current one into a0 and OpNextNeighbour jumps
+  // back to imm if there are any left.
+  OpNeighbours, OpLoadNeighbour, OpNextNeighbour,
+  // Reductions over all neighbours into reg.  OpReduceCount adds imm for
+  // each neighbour.  OpReduceMap adds the value of the arm of the range map
+  // code->ranges[imm] that each neighbour matches, and is followed by src
+  // OpRangeEntry instructions holding the arms' values in imm.
+  OpReduceSum, OpReduceMin, OpReduceMax, OpReduceCount, OpReduceMap,
+  OpHalt,
+  OpCount
 };
 
-int interpret(struct ASTNode *ast, struct InterpreterState *state);
+// A single bytecode instruction.  The opcode is replaced by the address of
+// its implementation in interpret() once the program has been generated, so
+// dispatch is a single indirect branch.
+struct instruction {
+  union {
+    uintptr_t opcode;
+    const void *label;
+  } op;
+  int16_t reg;
+  int16_t src;
+  int32_t imm;
+};
 
-// Runs a single step
-void runOneStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct ASTNode **ast, uintptr_t count)
+// A compiled program.
+struct bytecode {
+  // The maximum nesting depth of neighbours loops
+  int depth;
+  // The number of instructions
+  int count;
+  // The number of instructions that there is space for
+  int capacity;
+  struct instruction *ops;
+  // The preprocessed range maps that the program uses
+  int rangeCount;
+  struct rangeLookup **ranges;
+  // The local register slots that must be zeroed before each cell
+  int zeroCount;
+  int16_t zero[10];
+};
+
+// Emits a single instruction and returns its index.
+static int emit(struct bytecode *code, enum opcode op, int reg, int src,
+                int32_t imm)
 {
-  struct InterpreterState state = {0};
-  state.grid = oldgrid;
-  state.width = width;
-  state.height = height;
-  int i=0;
-  for (int x=0 ; x<width ; x++) {
-    for (int y=0 ; y<height ; y++,i++) {
-      state.v = oldgrid[i];
-      state.x = x;
-      state.y = y;
-      bzero(state.a, sizeof(state.a));
-      for (int step=0 ; step<count ; step++) {
-        interpret(ast[step], &state);
-      }
-      newgrid[i] = state.v;
+  if (code->count == code->capacity) {
+    code->capacity = code->capacity ? code->capacity * 2 : 32;
+    code->ops = realloc(code->ops, code->capacity * sizeof(struct instruction));
+  }
+  struct instruction *i = &code->ops[code->count];
+  i->op.opcode = op;
+  i->reg = reg;
+  i->src = src;
+  i->imm = imm;
+  return code->count++;
+}
+
+// The forms that an operand can take.  These are in the same order as the
+// variants of each arithmetic opcode.
+enum operand { OperandRegister, OperandImmediate, OperandAccumulator };
+
+static void emitRangeMap(struct bytecode *code, struct RangeMap *rm);
+
+// Emits the code for an expression.  Registers and literals don't need any
+// code, so their slot or value is returned in *operand.  Range expressions
+// leave their result in the accumulator.
+static enum operand emitExpression(struct bytecode *code, uintptr_t val,
+                                   int32_t *operand)
+{
+  if ((val & 3) == 3) {
+    int slot = readSlot(val);
+    if (slot >= 0) {
+      *operand = slot;
+      return OperandRegister;
     }
+    // Undefined registers always read as -1
+    *operand = -1;
+    return OperandImmediate;
+  }
+  if (val & 1) {
+    *operand = (int)(val >> 2);
+    return OperandImmediate;
   }
+  emitRangeMap(code, (struct RangeMap*)((struct ASTNode*)val)->val[0]);
+  return OperandAccumulator;
 }
 
-static void
-storeInLValue(uintptr_t reg, int val, struct InterpreterState *state) {
-  reg >>= 2;
-  if (reg < 10) {
-    state->a[reg] = val;
-  } else if (reg < 20) {
-    state->g[reg - 10] = val;
-  } else if (reg == 21) {
-    state->v = val;
+// Preprocesses a range map and returns its index in code->ranges.
+static int addRangeLookup(struct bytecode *code, struct RangeMap *rm) {
+  code->ranges = realloc(code->ranges,
+                         (code->rangeCount + 1) * sizeof(struct rangeLookup*));
+  code->ranges[code->rangeCount] = buildRangeLookup(rm);
+  return code->rangeCount++;
+}
+
+static void emitRangeMap(struct bytecode *code, struct RangeMap *rm) {
+  int32_t key;
+  enum operand form = emitExpression(code, rm->value, &key);
+  assert(form == OperandRegister && "Range maps must map a register");
+  int index = addRangeLookup(code, rm);
+  int entries = rm->count;
+  int range = emit(code, code->ranges[index]->table ? OpRangeTable :
+                   OpRangeSearch, key, entries, index);
+  for (int i=0 ; i<entries ; i++) {
+    emit(code, OpRangeEntry, 0, 0, 0);
+  }
+  // If nothing matches, the result is 0
+  int *exits = calloc(entries + 1, sizeof(int));
+  emit(code, OpAccI, 0, 0, 0);
+  exits[0] = emit(code, OpJump, 0, 0, 0);
+  for (int i=0 ; i<entries ; i++) {
+    code->ops[range + 1 + i].imm = code->count;
+    int32_t operand;
+    switch (emitExpression(code, rm->entries[i].val, &operand)) {
+      case OperandRegister:
+        emit(code, OpAccR, 0, operand, 0);
+        break;
+      case OperandImmediate:
+        emit(code, OpAccI, 0, 0, operand);
+        break;
+      case OperandAccumulator:
+        break;
+    }
+    exits[i+1] = emit(code, OpJump, 0, 0, 0);
   }
+  for (int i=0 ; i<=entries ; i++) {
+    code->ops[exits[i]].imm = code->count;
+  }
+  free(exits);
 }
 
-static int getRValue(uintptr_t val, struct InterpreterState *state) {
-  // If the low bit is 1, then this is either an immediate or a register
+static void emitStatement(struct bytecode *code, uintptr_t val, int depth) {
+  // Literals and registers are valid statements, but they don't do anything.
   if (val & 1) {
-    val >>= 1;
-    // Second lowest bit indicates that this is a register
-    if (val & 1) {
-      val >>= 1;
-      if (val < 10) {
-        return state->a[val];
+    return;
+  }
+  struct ASTNode *ast = (struct ASTNode*)val;
+  switch (ast->type) {
+    case NTNeighbours: {
+      if (depth >= code->depth) {
+        code->depth = depth + 1;
       }
-      if (val < 20) {
-        return state->g[val - 10];
+      int loop = emit(code, OpNeighbours, depth, 0, 0);
+      int body = code->count;
+      struct ASTNode **list = (struct ASTNode**)ast->val[1];
+      // a0 is reloaded with the neighbour's value before every statement
+      for (int i=0 ; i<ast->val[0]; i++) {
+        emit(code, OpLoadNeighbour, depth, 0, 0);
+        emitStatement(code, (uintptr_t)list[i], depth + 1);
       }
-      // Undefined values
-      if (val > 21) {
-        return -1;
+      emit(code, OpNextNeighbour, depth, 0, body);
+      code->ops[loop].imm = code->count;
+      break;
+    }
+    // Reductions don't need the generic loop: each one is a single
+    // instruction that visits all of the neighbours.
+    case NTReductions: {
+      struct ASTNode **list = (struct ASTNode**)ast->val[1];
+      for (int i=0 ; i<ast->val[0]; i++) {
+        emitStatement(code, (uintptr_t)list[i], depth);
       }
-      return state->v;
+      break;
     }
-    // Literal
-    return val >> 1;
-  }
-  // If the low bit is 0, this is a pointer to an AST node
-  return interpret((struct ASTNode*)val, state);
-}
-
-int interpret(struct ASTNode *ast, struct InterpreterState *state) {
-  switch (ast->type) {
-    case NTNeighbours:
-      // For each of the (valid) neighbours
-      for (int x = state->x - 1 ; x <= state->x + 1 ; x++) {
-        if (x < 0 || x >= state->width) continue;
-        for (int y = state->y - 1 ; y <= state->y + 1 ; y++) {
-          if (y < 0 || y >= state->height) continue;
-          if (x == state->x && y == state->y) continue;
-          for (int i=0 ; i<ast->val[0]; i++) {
-            state->a[0] = state->grid[x*state->width + y];
-            interpret(((struct ASTNode**)ast->val[1])[i], state);
-          }
+    case NTReduceSum:
+    case NTReduceMin:
+    case NTReduceMax:
+    case NTReduceCount: {
+      static const enum opcode ops[] = {
+        [NTReduceSum] = OpReduceSum,
+        [NTReduceMin] = OpReduceMin,
+        [NTReduceMax] = OpReduceMax
+      };
+      int slot = writeSlot(ast->val[0]);
+      uintptr_t arg = ast->val[1];
+      if (ast->type != NTReduceCount) {
+        emit(code, ops[ast->type], slot, 0, 0);
+      } else if (arg & 1) {
+        emit(code, OpReduceCount, slot, 0, (int)(arg >> 2));
+      } else {
+        struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)arg)->val[0];
+        emit(code, OpReduceMap, slot, rm->count, addRangeLookup(code, rm));
+        for (int i=0 ; i<rm->count ; i++) {
+          emit(code, OpRangeEntry, 0, 0, (int)(rm->entries[i].val >> 2));
         }
       }
       break;
-    case NTRangeMap: {
-      struct RangeMap *rm = (struct RangeMap*)ast->val[0];
-      int rvalue = getRValue(rm->value, state);
-      for (int i=0 ; i<rm->count ; i++) {
-        struct RangeMapEntry *re = &rm->entries[i];
-        if ((rvalue >= (re->min >> 2)) && (rvalue <= (re->max >> 2))) {
-          return getRValue(re->val, state);
-        }
+    }
+    // Range expressions have no side effects, so evaluating one as a
+    // statement does nothing.
+    case NTRangeMap:
+      break;
+    // Shifts always have a literal right-hand side
+    case NTOperatorShl:
+    case NTOperatorShr: {
+      int slot = writeSlot(ast->val[0]);
+      if (slot >= 0) {
+        emit(code, (ast->type == NTOperatorShl) ? OpShl : OpShr, slot, 0,
+             (int)(ast->val[1] >> 2));
       }
-      return 0;
+      break;
     }
     case NTOperatorAdd:
     case NTOperatorSub:
@@ -118,34 +239,266 @@ int interpret(struct ASTNode *ast, struct InterpreterState *state) {
     case NTOperatorAssign:
     case NTOperatorMin:
     case NTOperatorMax: {
-      int lvalue = getRValue(ast->val[0], state);
-      int rvalue = getRValue(ast->val[1], state);
-      switch (ast->type) {
-        case NTOperatorAdd:
-          rvalue = lvalue + rvalue;
-          break;
-        case NTOperatorSub:
-          rvalue = lvalue - rvalue;
-          break;
-        case NTOperatorMul:
-          rvalue = lvalue * rvalue;
-          break;
-        case NTOperatorDiv:
-          rvalue = lvalue / rvalue;
-          break;
-        case NTOperatorMin:
-          if (rvalue > lvalue)
-            rvalue = lvalue;
-          break;
-        case NTOperatorMax: 
-          if (rvalue < lvalue)
-            rvalue = lvalue;
-        default: break;
+      static const enum opcode ops[] = {
+        [NTOperatorAdd] = OpAddR,
+        [NTOperatorSub] = OpSubR,
+        [NTOperatorMul] = OpMulR,
+        [NTOperatorDiv] = OpDivR,
+        [NTOperatorAssign] = OpMovR,
+        [NTOperatorMin] = OpMinR,
+        [NTOperatorMax] = OpMaxR
+      };
+      int slot = writeSlot(ast->val[0]);
+      if (slot < 0) {
+        break;
+      }
+      int32_t operand;
+      enum operand form = emitExpression(code, ast->val[1], &operand);
+      emit(code, ops[ast->type] + form, slot,
+           (form == OperandRegister) ? operand : 0,
+           (form == OperandImmediate) ? operand : 0);
+    }
+  }
+}
+
+// Runs the program for a single cell.  Called with a NULL state, this instead
+// replaces each opcode in the program with the address of the code that
+// implements it.
+static void interpret(struct bytecode *code, struct InterpreterState *state) {
+  static const void *const labels[OpCount] = {
+    [OpAddR] = &&AddR, [OpAddI] = &&AddI, [OpAddA] = &&AddA,
+    [OpSubR] = &&SubR, [OpSubI] = &&SubI, [OpSubA] = &&SubA,
+    [OpMulR] = &&MulR, [OpMulI] = &&MulI, [OpMulA] = &&MulA,
+    [OpDivR] = &&DivR, [OpDivI] = &&DivI, [OpDivA] = &&DivA,
+    [OpMovR] = &&MovR, [OpMovI] = &&MovI, [OpMovA] = &&MovA,
+    [OpMinR] = &&MinR, [OpMinI] = &&MinI, [OpMinA] = &&MinA,
+    [OpMaxR] = &&MaxR, [OpMaxI] = &&MaxI, [OpMaxA] = &&MaxA,
+    [OpShl] = &&Shl, [OpShr] = &&Shr,
+    [OpAccR] = &&AccR, [OpAccI] = &&AccI,
+    [OpRangeTable] = &&RangeTable, [OpRangeSearch] = &&RangeSearch,
+    [OpRangeEntry] = &&Halt,
+    [OpJump] = &&Jump,
+    [OpNeighbours] = &&Neighbours,
+    [OpLoadNeighbour] = &&LoadNeighbour,
+    [OpNextNeighbour] = &&NextNeighbour,
+    [OpReduceSum] = &&ReduceSum, [OpReduceMin] = &&ReduceMin,
+    [OpReduceMax] = &&ReduceMax, [OpReduceCount] = &&ReduceCount,
+    [OpReduceMap] = &&ReduceMap,
+    [OpHalt] = &&Halt
+  };
+  if (state == NULL) {
+    for (int i=0 ; i<code->count ; i++) {
+      code->ops[i].op.label = labels[code->ops[i].op.opcode];
+    }
+    return;
+  }
+  int16_t *r = state->reg;
+  struct instruction *pc = code->ops;
+  // The result of the last range expression
+  int acc = 0;
+  // The index of the neighbour that each level of nested loop is visiting
+  int depth = code->depth ? code->depth : 1;
+  int current[depth];
+  const struct neighbourhood *n = state->neighbourhood;
+
+#define DISPATCH() goto *pc->op.label
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define ARITHMETIC(name, expr) \
+  name##R: { int l = r[pc->reg], rv = r[pc->src]; r[pc->reg] = (expr); NEXT(); } \
+  name##I: { int l = r[pc->reg], rv = pc->imm; r[pc->reg] = (expr); NEXT(); } \
+  name##A: { int l = r[pc->reg], rv = acc; r[pc->reg] = (expr); NEXT(); }
+
+  DISPATCH();
+  ARITHMETIC(Add, l + rv)
+  ARITHMETIC(Sub, l - rv)
+  ARITHMETIC(Mul, l * rv)
+  ARITHMETIC(Div, l / rv)
+  ARITHMETIC(Min, (rv > l) ? l : rv)
+  ARITHMETIC(Max, (rv < l) ? l : rv)
+Shl:
+  r[pc->reg] = (int)((unsigned)r[pc->reg] << pc->imm);
+  NEXT();
+Shr: {
+  // Adding 2^imm-1 to negative values makes the shift round towards zero
+  int l = r[pc->reg];
+  r[pc->reg] = (l + ((l >> 31) & ((1 << pc->imm) - 1))) >> pc->imm;
+  NEXT();
+}
+MovR:
+  r[pc->reg] = r[pc->src];
+  NEXT();
+MovI:
+  r[pc->reg] = pc->imm;
+  NEXT();
+MovA:
+  r[pc->reg] = acc;
+  NEXT();
+AccR:
+  acc = r[pc->src];
+  NEXT();
+AccI:
+  acc = pc->imm;
+  NEXT();
+RangeTable: {
+  int arm = rangeTableLookup(code->ranges[pc->imm], r[pc->reg]);
+  pc = (arm < 0) ? pc + 1 + pc->src : code->ops + pc[1 + arm].imm;
+  DISPATCH();
+}
+RangeSearch: {
+  int arm = rangeSearch(code->ranges[pc->imm], r[pc->reg]);
+  pc = (arm < 0) ? pc + 1 + pc->src : code->ops + pc[1 + arm].imm;
+  DISPATCH();
+}
+Jump:
+  pc = code->ops + pc->imm;
+  DISPATCH();
+Neighbours:
+  if (n->count == 0) {
+    pc = code->ops + pc->imm;
+    DISPATCH();
+  }
+  current[pc->reg] = 0;
+  NEXT();
+LoadNeighbour:
+  r[SlotA] = state->cell[n->offsets[current[pc->reg]]];
+  NEXT();
+NextNeighbour:
+  if (++current[pc->reg] < n->count) {
+    pc = code->ops + pc->imm;
+    DISPATCH();
+  }
+  NEXT();
+  // Interior cells always have eight neighbours, and a constant trip count
+  // lets the compiler unroll the loop completely.
+#define REDUCE(name, combine) \
+  name: { \
+    const int16_t *cell = state->cell; \
+    const int *o = n->offsets; \
+    int acc = r[pc->reg]; \
+    if (n->count == 8) { \
+      for (int k=0 ; k<8 ; k++) { int nv = cell[o[k]]; acc = (combine); } \
+    } else { \
+      for (int k=0 ; k<n->count ; k++) { int nv = cell[o[k]]; acc = (combine); } \
+    } \
+    r[pc->reg] = acc; \
+    NEXT(); \
+  }
+  REDUCE(ReduceSum, acc + nv)
+  REDUCE(ReduceMin, (nv > acc) ? acc : nv)
+  REDUCE(ReduceMax, (nv < acc) ? acc : nv)
+ReduceCount:
+  r[pc->reg] += pc->imm * n->count;
+  NEXT();
+ReduceMap: {
+  const struct rangeLookup *l = code->ranges[pc->imm];
+  int acc = r[pc->reg];
+  for (int k=0 ; k<n->count ; k++) {
+    int arm = findArm(l, state->cell[n->offsets[k]]);
+    acc += (arm < 0) ? 0 : pc[1 + arm].imm;
+  }
+  r[pc->reg] = acc;
+  pc += 1 + pc->src;
+  DISPATCH();
+}
+Halt:
+  return;
+#undef REDUCE
+#undef ARITHMETIC
+#undef NEXT
+#undef DISPATCH
+}
+
+struct bytecode *compileBytecode(struct ASTNode **ast, uintptr_t count)
+{
+  struct bytecode *code = calloc(1, sizeof(struct bytecode));
+  uint16_t live = liveLocalRegisters(ast, count);
+  for (int i=0 ; i<10 ; i++) {
+    if (live & (1 << i)) {
+      code->zero[code->zeroCount++] = SlotA + i;
+    }
+  }
+  for (uintptr_t i=0 ; i<count ; i++) {
+    emitStatement(code, (uintptr_t)ast[i], 0);
+  }
+  emit(code, OpHalt, 0, 0, 0);
+  interpret(code, NULL);
+  return code;
+}
+
+// The arguments for running the bytecode over a band of rows
+struct bytecodeStep {
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+  struct bytecode *code;
+};
+
+// Runs the cells in rows [xBegin, xEnd) and columns [yBegin, yEnd) of a
+// single step.  Each call has its own interpreter state, so regions can run
+// concurrently.
+static void runRegion(void *context, int16_t xBegin, int16_t xEnd,
+                      int16_t yBegin, int16_t yEnd)
+{
+  struct bytecodeStep *step = context;
+  struct InterpreterState state = {{0}};
+  struct neighbourhood neighbourhoods[16];
+  buildNeighbourhoods(neighbourhoods, step->height);
+  for (int x=xBegin ; x<xEnd ; x++) {
+    int i = gridIndex(x, yBegin, step->height);
+    for (int y=yBegin ; y<yEnd ; y++,i++) {
+      state.reg[SlotV] = step->oldgrid[i];
+      state.cell = &step->oldgrid[i];
+      state.neighbourhood =
+        &neighbourhoods[neighbourClass(x, y, step->width, step->height)];
+      for (int z=0 ; z<step->code->zeroCount ; z++) {
+        state.reg[step->code->zero[z]] = 0;
       }
-      storeInLValue(ast->val[0], rvalue, state);
+      interpret(step->code, &state);
+      step->newgrid[i] = state.reg[SlotV];
     }
   }
-  return 0;
+}
+
+// Runs a single step of the cells in a region, with the grids passed
+// directly.  This is a kernelFn, for executors that manage their own grids.
+void interpretRegion(void *program, int16_t *oldgrid, int16_t *newgrid,
+        int16_t width, int16_t height, int16_t xBegin, int16_t xEnd,
+        int16_t yBegin, int16_t yEnd)
+{
+  struct bytecodeStep step = { oldgrid, newgrid, width, height, program };
+  runRegion(&step, xBegin, xEnd, yBegin, yEnd);
+}
+
+static void runRows(void *context, int16_t rowBegin, int16_t rowEnd)
+{
+  struct bytecodeStep *step = context;
+  runRegion(context, rowBegin, rowEnd, 0, step->height);
+}
+
+// Runs the program for one cell, whose neighbours are given by n, and returns
+// its new value.  This is for engines that don't store the cells in a grid.
+// The global registers always start at zero.
+int16_t interpretCell(struct bytecode *code, const int16_t *cell,
+                      const struct neighbourhood *n)
+{
+  struct InterpreterState state = {{0}};
+  state.reg[SlotV] = *cell;
+  state.cell = cell;
+  state.neighbourhood = n;
+  interpret(code, &state);
+  return state.reg[SlotV];
+}
+
+// Runs a single step, split across the threads in pool (if any)
+void runOneStep(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, struct bytecode *code, struct threadPool *pool, struct tileGrid *tiles)
+{
+  struct bytecodeStep step = { oldgrid, newgrid, width, height, code };
+  if (tiles) {
+    runTiles(tiles, oldgrid, newgrid, runRegion, &step, pool);
+  } else {
+    runInBands(pool, width, runRows, &step);
+  }
 }
 
 void printAST(struct ASTNode *ast) {
@@ -170,8 +523,9 @@ void printAST(struct ASTNode *ast) {
     return;
   }
   switch (ast->type) {
-    case NTNeighbours:{
-      printf("neighbours (\n");
+    case NTNeighbours:
+    case NTReductions: {
+      printf((ast->type == NTNeighbours) ? "neighbours (\n" : "reduce (\n");
           for (int i=0 ; i<ast->val[0]; i++) {
             printAST(((struct ASTNode**)ast->val[1])[i]);
       }
@@ -202,7 +556,13 @@ void printAST(struct ASTNode *ast) {
     case NTOperatorDiv:
     case NTOperatorAssign:
     case NTOperatorMin:
-    case NTOperatorMax: {
+    case NTOperatorMax:
+    case NTOperatorShl:
+    case NTOperatorShr:
+    case NTReduceSum:
+    case NTReduceMin:
+    case NTReduceMax:
+    case NTReduceCount: {
       switch (ast->type) {
         case NTOperatorAssign:
           printf("= ");
@@ -224,6 +584,24 @@ void printAST(struct ASTNode *ast) {
           break;
         case NTOperatorMax: 
           printf("max ");
+          break;
+        case NTOperatorShl:
+          printf("<< ");
+          break;
+        case NTOperatorShr:
+          printf(">> ");
+          break;
+        case NTReduceSum:
+          printf("sum ");
+          break;
+        case NTReduceMin:
+          printf("rmin ");
+          break;
+        case NTReduceMax:
+          printf("rmax ");
+          break;
+        case NTReduceCount:
+          printf("count ");
         default: break;
       }
       printAST((struct ASTNode*)ast->val[0]);
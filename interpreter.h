@@ -0,0 +1,96 @@
+// State shared by the interpreters (interpreter.c and closure.c).  This is
+// not part of the public interface in AST.h.
+#include "AST.h"
+
+// Register slots used by the interpreters.  The local registers live in slots
+// 0-9, the global registers in 10-19 and the cell value in slot 20.
+enum {
+  SlotA = 0,
+  SlotG = 10,
+  SlotV = 20,
+  SlotCount
+};
+
+// The current state for the interpreter
+struct InterpreterState {
+  // The registers, indexed by slot number
+  int16_t reg[SlotCount];
+  // The current cell in the old grid
+  const int16_t *cell;
+  // The neighbours of the current cell
+  const struct neighbourhood *neighbourhood;
+};
+
+// Returns the slot that reading the specified register refers to, or -1 for
+// an undefined register.
+static inline int readSlot(uintptr_t reg) {
+  reg >>= 2;
+  if (reg < 10) {
+    return SlotA + reg;
+  }
+  if (reg < 20) {
+    return SlotG + reg - 10;
+  }
+  if (reg > 21) {
+    return -1;
+  }
+  return SlotV;
+}
+
+// Returns the slot that writing the specified register refers to, or -1 if
+// the write should be discarded.
+static inline int writeSlot(uintptr_t reg) {
+  reg >>= 2;
+  if (reg < 20) {
+    return readSlot(reg << 2);
+  }
+  return (reg == 21) ? SlotV : -1;
+}
+
+// A range map, preprocessed so that finding the arm for a key doesn't need to
+// scan every entry.  Built by buildRangeLookup() in rangemap.c.
+struct rangeInterval {
+  int min;
+  int max;
+  // The index of the entry in the original range map
+  int arm;
+};
+
+struct rangeLookup {
+  // A table holding the arm for every key from lowest to lowest+size-1, or -1
+  // for keys that no arm matches.  NULL if the keys span too many values.
+  int16_t *table;
+  int lowest;
+  int size;
+  // Disjoint intervals, sorted by key, with the arm that each maps to.
+  struct rangeInterval *intervals;
+  int count;
+};
+
+struct rangeLookup *buildRangeLookup(struct RangeMap *rm);
+
+// Returns the index of the first arm of the range map that matches key, or -1
+// if none does.
+static inline int rangeTableLookup(const struct rangeLookup *l, int key) {
+  unsigned index = key - l->lowest;
+  return (index < (unsigned)l->size) ? l->table[index] : -1;
+}
+
+static inline int rangeSearch(const struct rangeLookup *l, int key) {
+  const struct rangeInterval *r = l->intervals;
+  int count = l->count;
+  while (count > 0) {
+    int half = count / 2;
+    if (r[half].max < key) {
+      r += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+  return ((r < l->intervals + l->count) && (r->min <= key)) ? r->arm : -1;
+}
+
+static inline int findArm(const struct rangeLookup *l, int key) {
+  return l->table ? rangeTableLookup(l, key) : rangeSearch(l, key);
+}
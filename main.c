@@ -1,7 +1,10 @@
 #include <ctype.h>
+#include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include "grammar.h"
@@ -32,6 +35,159 @@ static void logTimeSince(clock_t c1, char *msg)
     ((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC, r.ru_maxrss);
 }
 
+// The arguments for running a compiled automaton over a band of rows or a
+// region
+struct compiledStep {
+  rowAutomaton ca;
+  regionAutomaton region;
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+};
+
+static void runCompiledRows(void *context, int16_t rowBegin, int16_t rowEnd)
+{
+  struct compiledStep *step = context;
+  step->ca(step->oldgrid, step->newgrid, step->width, step->height, rowBegin, rowEnd);
+}
+
+static void runCompiledRegion(void *context, int16_t xBegin, int16_t xEnd,
+                              int16_t yBegin, int16_t yEnd)
+{
+  struct compiledStep *step = context;
+  step->region(step->oldgrid, step->newgrid, step->width, step->height,
+      xBegin, xEnd, yBegin, yEnd);
+}
+
+static void runCompiledKernel(void *program, int16_t *oldgrid,
+                              int16_t *newgrid, int16_t width, int16_t height,
+                              int16_t xBegin, int16_t xEnd, int16_t yBegin,
+                              int16_t yEnd)
+{
+  regionAutomaton region = *(regionAutomaton*)program;
+  region(oldgrid, newgrid, width, height, xBegin, xEnd, yBegin, yEnd);
+}
+
+// Runs one generation of a compiled automaton, with whichever entry point
+// suits the threads and tiles.
+static void runCompiledStep(automaton ca, rowAutomaton rows,
+                            regionAutomaton region, int16_t *oldgrid,
+                            int16_t *newgrid, int gridSize,
+                            struct threadPool *pool, struct tileGrid *tiles)
+{
+  struct compiledStep step = { rows, region, oldgrid, newgrid, gridSize,
+                               gridSize };
+  if (tiles) {
+    runTiles(tiles, oldgrid, newgrid, runCompiledRegion, &step, pool);
+  } else if (pool) {
+    runInBands(pool, gridSize, runCompiledRows, &step);
+  } else {
+    ca(oldgrid, newgrid, gridSize, gridSize);
+  }
+}
+
+// Runs all of the generations, blockDepth at a time, swapping the grids after
+// each block.
+static void runInBlocks(int16_t **g1, int16_t **g2, int gridSize,
+                        int iterations, int blockDepth, kernelFn fn,
+                        void *program, struct threadPool *pool)
+{
+  for (int i=0 ; i<iterations ; i+=blockDepth) {
+    int generations = (iterations - i < blockDepth) ? iterations - i : blockDepth;
+    runBlocked(*g1, *g2, gridSize, gridSize, generations, fn, program, pool);
+    int16_t *tmp = *g1;
+    *g1 = *g2;
+    *g2 = tmp;
+  }
+}
+
+// Runs all of the generations as a pipeline across the threads, leaving the
+// result in *g1.
+static void runInPipeline(int16_t **g1, int16_t **g2, int gridSize,
+                          int iterations, kernelFn fn, void *program,
+                          struct threadPool *pool)
+{
+  runPipelined(*g1, *g2, gridSize, gridSize, iterations, fn, program, pool);
+  if (iterations & 1) {
+    int16_t *tmp = *g1;
+    *g1 = *g2;
+    *g2 = tmp;
+  }
+}
+
+// Compiles the program to a native object file for the specified CPU.
+// Returns 0 on success.
+static int writeObject(struct statements *program, int optimiseLevel,
+                       const char *cpu, const char *filename)
+{
+  struct jitCompiler *jit = createJITCompiler();
+  int status = compileToObject(jit, program->list, program->count,
+      optimiseLevel, cpu, filename);
+  destroyJITCompiler(jit);
+  return status;
+}
+
+// Writes the program to a file as a native object.  If the name ends in .so,
+// the object is linked into a shared library that can be loaded with -L.
+// Returns 0 on success.
+static int writeKernel(struct statements *program, int optimiseLevel,
+                       const char *cpu, const char *filename)
+{
+  size_t length = strlen(filename);
+  if ((length < 3) || strcmp(filename + length - 3, ".so")) {
+    return writeObject(program, optimiseLevel, cpu, filename);
+  }
+  char *object = malloc(length + 3);
+  sprintf(object, "%s.o", filename);
+  int status = writeObject(program, optimiseLevel, cpu, object);
+  if (status == 0) {
+    pid_t child = fork();
+    if (child == 0) {
+      execlp("cc", "cc", "-shared", "-o", filename, object, (char*)NULL);
+      _exit(127);
+    }
+    if ((child < 0) || (waitpid(child, &status, 0) < 0)) {
+      status = -1;
+    }
+  }
+  unlink(object);
+  free(object);
+  return status;
+}
+
+// Loads a kernel written with -S, checking that it was compiled from the
+// same program and that this machine can run it.  Exits if it can't be
+// loaded.
+static automaton loadKernel(const char *filename, struct statements *program,
+                            rowAutomaton *rows, regionAutomaton *region)
+{
+  void *library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(-1);
+  }
+  uint64_t *hash = dlsym(library, "automatonProgramHash");
+  if (!hash || (*hash != hashProgram(program->list, program->count))) {
+    fprintf(stderr, "%s was not compiled from this program\n", filename);
+    exit(-1);
+  }
+  // Code generated for another CPU may use instructions that this one
+  // doesn't have.  Generic code runs anywhere, and so does code for this CPU
+  // that doesn't ask for any extra features.
+  const char *cpu = dlsym(library, "automatonTargetCPU");
+  const char *features = dlsym(library, "automatonTargetFeatures");
+  if (!cpu || !features || *features ||
+      (strcmp(cpu, "generic") && strcmp(cpu, hostCPUName()))) {
+    fprintf(stderr, "%s was compiled for a different CPU (%s %s)\n",
+        filename, cpu ? cpu : "unknown", features ? features : "");
+    exit(-1);
+  }
+  *rows = (rowAutomaton)dlsym(library, "automatonRows");
+  *region = (regionAutomaton)dlsym(library, "automatonRegion");
+  return (automaton)dlsym(library, "automaton");
+}
+
 static int digittoint(char c)
 {
   return ( (int) (c  - '0') );
@@ -44,16 +200,64 @@ int main(int argc, char **argv)
 #endif
   int iterations = 1;
   int useJIT = 0;
+  int useTiers = 0;
+  int chooseBackendAutomatically = 0;
+  int calibrate = 0;
+  int useClosures = 0;
+  int useBatches = 0;
+  int useHashlife = 0;
+  int useTiles = 0;
+  int useTables = 1;
+  int useIncremental = 0;
+  int blockDepth = 1;
+  int usePipeline = 0;
+  const char *objectFile = NULL;
+  const char *kernelFile = NULL;
+  const char *targetCPU = "generic";
   int optimiseLevel = 0;
   int gridSize = 5;
   int maxValue = 1;
+  int threads = 1;
   clock_t c1;
   int c, f;
-  while ((c = getopt(argc, argv, "ji:to:x:m:")) != -1) {
+  while ((c = getopt(argc, argv, "jJAPcbdnHIwi:k:to:x:m:T:C:S:L:M:")) != -1) {
     switch (c) {
       case 'j':
         useJIT = 1;
         break;
+      case 'J':
+        useTiers = 1;
+        break;
+      case 'A':
+        chooseBackendAutomatically = 1;
+        break;
+      case 'P':
+        calibrate = 1;
+        break;
+      case 'c':
+        useClosures = 1;
+        break;
+      case 'b':
+        useBatches = 1;
+        break;
+      case 'd':
+        useTiles = 1;
+        break;
+      case 'n':
+        useTables = 0;
+        break;
+      case 'H':
+        useHashlife = 1;
+        break;
+      case 'I':
+        useIncremental = 1;
+        break;
+      case 'w':
+        usePipeline = 1;
+        break;
+      case 'k':
+        blockDepth = strtol(optarg, 0, 10);
+        break;
       case 'x':
         gridSize = strtol(optarg, 0, 10);
         break;
@@ -68,6 +272,22 @@ int main(int argc, char **argv)
         break;
       case 'o':
         optimiseLevel = strtol(optarg, 0, 10);
+        break;
+      case 'T':
+        threads = strtol(optarg, 0, 10);
+        break;
+      case 'C':
+        setObjectCacheDirectory(optarg);
+        break;
+      case 'S':
+        objectFile = optarg;
+        break;
+      case 'L':
+        kernelFile = optarg;
+        break;
+      case 'M':
+        targetCPU = optarg;
+        break;
     }
   }
 
@@ -166,12 +386,33 @@ resume_parsing:
   }
   CellAtomParse(parser, 0, 0, &result);
   CellAtomParseFree(parser, free);
+  c1 = clock();
+  result->count = optimiseAST(result->list, result->count);
+  logTimeSince(c1, "Optimising");
 #ifdef DUMP_AST
   for (uintptr_t i=0 ; i<result->count ; i++) {
     printAST(result->list[i]);
     putchar('\n');
   }
 #endif
+  // Compiling ahead of time doesn't run anything
+  if (objectFile) {
+    c1 = clock();
+    int status = writeKernel(result, optimiseLevel, targetCPU, objectFile);
+    logTimeSince(c1, "Writing kernel");
+    return status ? -1 : 0;
+  }
+  // Calibrating measures this machine with the program, rather than running
+  // it.
+  if (calibrate) {
+    struct hostProfile profile;
+    calibrateProfile(&profile, result->list, result->count);
+    if (writeProfile(&profile, profileFile())) {
+      fprintf(stderr, "Can't write %s\n", profileFile());
+      return -1;
+    }
+    return 0;
+  }
   /*
   int16_t oldgrid[] = {
      0,0,0,0,0,
@@ -182,41 +423,325 @@ resume_parsing:
   };
   int16_t newgrid[25];
   */
-  int16_t *g1 = malloc(gridSize * sizeof(int16_t) * gridSize);
-  for (int i=0 ; i<(gridSize*gridSize) ; i++) {
-    g1[i] = random() % (maxValue + 1);
+  // Both grids have a zeroed halo around them (see grid.h)
+  int16_t *g1 = calloc(gridCells(gridSize, gridSize), sizeof(int16_t));
+  for (int x=0 ; x<gridSize ; x++) {
+    for (int y=0 ; y<gridSize ; y++) {
+      g1[gridIndex(x, y, gridSize)] = random() % (maxValue + 1);
+    }
   }
-  int16_t *g2 = malloc(gridSize * sizeof(int16_t) * gridSize);
+  int16_t *g2 = calloc(gridCells(gridSize, gridSize), sizeof(int16_t));
   c1 = clock();
   logTimeSince(c1, "Generating random grid");
-  int i=0;
-  if (useJIT) {
+  // Programs that use the global registers depend on the cells being visited
+  // in order, so they can't be split across threads.
+  struct threadPool *pool = NULL;
+  if ((threads > 1) && !usesGlobalRegisters(result->list, result->count)) {
+    pool = createThreadPool(threads);
+  }
+  // A loaded kernel is what the caller asked to run, so it mustn't be
+  // replaced by a table, a bit grid or Hashlife.
+  if (kernelFile) {
+    if (useHashlife || useIncremental) {
+      fprintf(stderr, "Hashlife and incremental updates can't run a loaded kernel\n");
+    }
+    useTables = 0;
+    useHashlife = 0;
+    useIncremental = 0;
+  }
+  if (useHashlife && usesGlobalRegisters(result->list, result->count)) {
+    fprintf(stderr, "Hashlife can't run programs that use global registers\n");
+    useHashlife = 0;
+  }
+  if ((blockDepth > 1) && usesGlobalRegisters(result->list, result->count)) {
+    fprintf(stderr, "Can't run several generations at once in programs that use global registers\n");
+    blockDepth = 1;
+  }
+  if (usePipeline && usesGlobalRegisters(result->list, result->count)) {
+    fprintf(stderr, "Can't pipeline generations in programs that use global registers\n");
+    usePipeline = 0;
+  }
+  if (useBatches && writesGlobalRegisters(result->list, result->count)) {
+    fprintf(stderr, "Can't batch programs that write to global registers\n");
+  }
+  // Skipping tiles whose neighbourhoods didn't change assumes that each cell
+  // only depends on its neighbours.
+  struct tileGrid *tiles = NULL;
+  if (useTiles && usesGlobalRegisters(result->list, result->count)) {
+    fprintf(stderr, "Can't skip unchanged tiles in programs that use global registers\n");
+  } else if (useTiles) {
+    tiles = createTileGrid(gridSize, gridSize);
+  }
+  // Programs that only look at the sum of their neighbours can be replaced
+  // by a table of their results.  Two-state ones can run on a grid with one
+  // bit per cell.
+  struct bitGrid *bits = NULL;
+  struct ruleTable *table = NULL;
+  if (useTables && !useHashlife &&
+      isOuterTotalistic(result->list, result->count)) {
+    c1 = clock();
+    struct bytecode *code = compileBytecode(result->list, result->count);
+    if ((maxValue == 1) && !useIncremental) {
+      bits = createBitGrid(code, g1, gridSize, gridSize);
+    }
+    if (!bits) {
+      table = createRuleTable(code, maxValue);
+    }
+    logTimeSince(c1, "Tabulating rule");
+  }
+  if (useIncremental && !table) {
+    fprintf(stderr, "Incremental updates only work for programs that only sum their neighbours\n");
+  }
+  // Incremental updates run on one thread, only visit the cells whose
+  // neighbours changed, and don't generate any code.  The table and the bit
+  // grid are chosen automatically, so say which options they ignore.
+  if (table && useIncremental) {
+    if (pool) {
+      fprintf(stderr, "Incremental updates only run on one thread\n");
+    }
+    if (tiles) {
+      fprintf(stderr, "Incremental updates already skip unchanged cells, so -d does nothing\n");
+    }
+    if (useJIT) {
+      fprintf(stderr, "Incremental updates don't use the JIT\n");
+    }
+  } else if (table && useJIT) {
+    fprintf(stderr, "The transition table was chosen automatically and doesn't use the JIT (-n turns it off)\n");
+  } else if (bits && tiles) {
+    fprintf(stderr, "The bit-packed grid was chosen automatically and can't skip unchanged tiles (-n turns it off)\n");
+  }
+  // Pick the backend that the host's profile says will finish first.  This
+  // is only a choice between the interpreter and the JIT, so it doesn't
+  // apply if another engine is going to run the program.
+  if (chooseBackendAutomatically && !table && !bits && !useHashlife &&
+      !useTiers && !kernelFile) {
+    struct hostProfile profile;
+    defaultProfile(&profile);
+    readProfile(&profile, profileFile());
+    double operations = (double)programCost(result->list, result->count) *
+                        gridSize * gridSize * iterations;
+    double estimates[3];
+    int backend = chooseBackend(&profile, operations, threadPoolSize(pool),
+        estimates);
+    useJIT = (backend != BackendInterpreter);
+    optimiseLevel = (backend == BackendOptimised) ? OptimisedLevel : 0;
+    if (enableTiming) {
+      const char *names[] = { "the interpreter", "unoptimised JIT code",
+                              "optimised JIT code" };
+      fprintf(stderr, "Estimated %f seconds in the interpreter, %f at -o 0 "
+          "and %f at -o %d.  Using %s.\n", estimates[BackendInterpreter],
+          estimates[BackendCompiled], estimates[BackendOptimised],
+          OptimisedLevel, names[backend]);
+    }
+  }
+  // Only the interpreter, the closures and the JIT run a generation at a
+  // time through a kernel, which is what pipelining and blocking need.
+  const char *stepEngine = NULL;
+  if (table && useIncremental) {
+    stepEngine = "incremental updates";
+  } else if (table) {
+    stepEngine = "the transition table, which was chosen automatically (-n turns it off)";
+  } else if (bits) {
+    stepEngine = "the bit-packed grid, which was chosen automatically (-n turns it off)";
+  } else if (useHashlife) {
+    stepEngine = "Hashlife";
+  } else if (useTiers && !kernelFile) {
+    stepEngine = "tiered compilation";
+  } else if (useBatches && !useJIT && !kernelFile &&
+             !writesGlobalRegisters(result->list, result->count)) {
+    stepEngine = "batches";
+  }
+  if ((usePipeline || (blockDepth > 1)) && stepEngine) {
+    fprintf(stderr, "Can't run several generations at once with %s\n",
+        stepEngine);
+    usePipeline = 0;
+    blockDepth = 1;
+  }
+  // Pipelining and blocking visit every cell
+  if (tiles && (usePipeline || (blockDepth > 1))) {
+    fprintf(stderr, "Can't skip unchanged tiles when running several generations at once\n");
+    destroyTileGrid(tiles);
+    tiles = NULL;
+  }
+  // Set if a compile that is no longer needed is still running
+  int compileInBackground = 0;
+  if (table && useIncremental) {
+    c1 = clock();
+    struct incrementalGrid *inc =
+      createIncrementalGrid(table, g1, gridSize, gridSize);
+    runIncrementalGrid(inc, iterations);
+    readIncrementalGrid(inc, g1);
+    destroyIncrementalGrid(inc);
+    destroyRuleTable(table);
+    logTimeSince(c1, "Running incremental updates");
+  } else if (table) {
     c1 = clock();
-    automaton ca = compile(result->list, result->count, optimiseLevel);
-    logTimeSince(c1, "Compiling");
+    for (int i=0 ; i<iterations ; i++) {
+      int16_t *tmp = g1;
+      runRuleTable(g1, g2, gridSize, gridSize, table, pool, tiles);
+      g1 = g2;
+      g2 = tmp;
+    }
+    destroyRuleTable(table);
+    logTimeSince(c1, "Running transition table");
+  } else if (bits) {
+    struct jitCompiler *jit = NULL;
+    struct compiledAutomaton *compiled = NULL;
+    if (useJIT) {
+      c1 = clock();
+      uint16_t born, survive;
+      bitGridRule(bits, &born, &survive);
+      jit = createJITCompiler();
+      compiled = compileBitAutomaton(jit, born, survive, optimiseLevel);
+      setBitAutomaton(bits, compiled->bits);
+      logTimeSince(c1, "Compiling");
+    }
+    c1 = clock();
+    runBitGrid(bits, iterations, pool);
+    readBitGrid(bits, g1);
+    destroyBitGrid(bits);
+    freeAutomaton(compiled);
+    destroyJITCompiler(jit);
+    logTimeSince(c1, "Running bit-packed version");
+  } else if (useHashlife) {
+    c1 = clock();
+    struct bytecode *code = compileBytecode(result->list, result->count);
+    struct hashlife *h = createHashlife(code, g1, gridSize, gridSize);
+    logTimeSince(c1, "Building quadtree");
     c1 = clock();
+    runHashlife(h, iterations);
+    readHashlife(h, g1);
+    logTimeSince(c1, "Running hashlife");
+  } else if (useTiers && !kernelFile) {
+    // Interpret until the compiled version is ready
+    c1 = clock();
+    struct bytecode *code = compileBytecode(result->list, result->count);
+    struct tieredCompiler *tiers =
+      startTieredCompiler(result->list, result->count, optimiseLevel);
+    int tier = 0;
+    automaton ca;
+    rowAutomaton rows;
+    regionAutomaton region;
     for (int i=0 ; i<iterations ; i++) {
       int16_t *tmp = g1;
-      ca(g1, g2, gridSize, gridSize);
+      int latest = latestTier(tiers, &ca, &rows, &region);
+      if (latest != tier) {
+        tier = latest;
+        if (enableTiming) {
+          fprintf(stderr, "Switched to compiled tier %d after %d generations\n",
+              tier, i);
+        }
+      }
+      if (tier) {
+        runCompiledStep(ca, rows, region, g1, g2, gridSize, pool, tiles);
+      } else {
+        runOneStep(g1, g2, gridSize, gridSize, code, pool, tiles);
+      }
       g1 = g2;
       g2 = tmp;
     }
+    compileInBackground = finishTieredCompiler(tiers);
+    logTimeSince(c1, "Running tiers");
+  } else if (useJIT || kernelFile) {
+    c1 = clock();
+    rowAutomaton rows;
+    regionAutomaton region;
+    automaton ca;
+    struct jitCompiler *jit = NULL;
+    struct compiledAutomaton *compiled = NULL;
+    if (kernelFile) {
+      ca = loadKernel(kernelFile, result, &rows, &region);
+      logTimeSince(c1, "Loading kernel");
+    } else {
+      jit = createJITCompiler();
+      compiled = compile(jit, result->list, result->count, optimiseLevel);
+      ca = compiled->ca;
+      rows = compiled->rows;
+      region = compiled->region;
+      logTimeSince(c1, "Compiling");
+    }
+    c1 = clock();
+    if (usePipeline) {
+      runInPipeline(&g1, &g2, gridSize, iterations, runCompiledKernel, &region, pool);
+    } else if (blockDepth > 1) {
+      runInBlocks(&g1, &g2, gridSize, iterations, blockDepth,
+          runCompiledKernel, &region, pool);
+    } else {
+      for (int i=0 ; i<iterations ; i++) {
+        int16_t *tmp = g1;
+        runCompiledStep(ca, rows, region, g1, g2, gridSize, pool, tiles);
+        g1 = g2;
+        g2 = tmp;
+      }
+    }
+    freeAutomaton(compiled);
+    destroyJITCompiler(jit);
     logTimeSince(c1, "Running compiled version");
-  } else {
+  } else if (useBatches &&
+             !writesGlobalRegisters(result->list, result->count)) {
+    c1 = clock();
+    struct batchProgram *program = compileBatch(result->list, result->count);
+    logTimeSince(c1, "Generating batches");
     c1 = clock();
     for (int i=0 ; i<iterations ; i++) {
       int16_t *tmp = g1;
-      runOneStep(g1, g2, gridSize, gridSize, result->list, result->count);
+      runBatchStep(g1, g2, gridSize, gridSize, program, pool, tiles);
       g1 = g2;
       g2 = tmp;
     }
+    logTimeSince(c1, "Running batches");
+  } else if (useClosures) {
+    c1 = clock();
+    struct closures *program = compileClosures(result->list, result->count);
+    logTimeSince(c1, "Generating closures");
+    c1 = clock();
+    if (usePipeline) {
+      runInPipeline(&g1, &g2, gridSize, iterations, runClosureRegion, program, pool);
+    } else if (blockDepth > 1) {
+      runInBlocks(&g1, &g2, gridSize, iterations, blockDepth,
+          runClosureRegion, program, pool);
+    } else {
+      for (int i=0 ; i<iterations ; i++) {
+        int16_t *tmp = g1;
+        runClosureStep(g1, g2, gridSize, gridSize, program, pool, tiles);
+        g1 = g2;
+        g2 = tmp;
+      }
+    }
+    logTimeSince(c1, "Running closures");
+  } else {
+    c1 = clock();
+    struct bytecode *code = compileBytecode(result->list, result->count);
+    logTimeSince(c1, "Generating bytecode");
+    c1 = clock();
+    if (usePipeline) {
+      runInPipeline(&g1, &g2, gridSize, iterations, interpretRegion, code, pool);
+    } else if (blockDepth > 1) {
+      runInBlocks(&g1, &g2, gridSize, iterations, blockDepth,
+          interpretRegion, code, pool);
+    } else {
+      for (int i=0 ; i<iterations ; i++) {
+        int16_t *tmp = g1;
+        runOneStep(g1, g2, gridSize, gridSize, code, pool, tiles);
+        g1 = g2;
+        g2 = tmp;
+      }
+    }
     logTimeSince(c1, "Interpreting");
   }
+  destroyThreadPool(pool);
+  destroyTileGrid(tiles);
   for (int x=0 ; x<gridSize ; x++) {
     for (int y=0 ; y<gridSize ; y++) {
-      printf("%d ", g1[i++]);
+      printf("%d ", g1[gridIndex(x, y, gridSize)]);
     }
     putchar('\n');
   }
+  // The compile may still be using LLVM, which returning from main() would
+  // tear down underneath it.
+  if (compileInBackground) {
+    fflush(stdout);
+    _exit(0);
+  }
   return 0;
 }
@@ -0,0 +1,500 @@
+#include "AST.h"
+#include <stdlib.h>
+
+// The AST optimiser.  This runs after parsing and before any of the back
+// ends, and rewrites the program in place.  It performs three
+// transformations:
+//
+// - Constant propagation and folding.  The local registers are zero at the
+//   start of every cell, so operations on them can often be evaluated at
+//   compile time.  Range maps with a known key are replaced by the selected
+//   arm.
+// - Strength reduction.  Multiplication and division by powers of two become
+//   shifts, and operations with an identity operand are removed.
+// - Dead store elimination.  Writes to registers that are never read again
+//   are removed, which also tells the back ends which local registers need to
+//   be zeroed at the start of each cell.
+//
+// Registers are tracked as bits in a mask: the local registers are 0-9, the
+// global registers 10-19, and v is 20.
+
+enum {
+  LocalRegisters = 0x3ff,
+  GlobalRegisters = 0x3ff << 10,
+  ValueRegister = 1 << 20,
+  A0 = 1
+};
+
+// Returns the bit for reading the specified register, or -1 for registers
+// that don't exist.
+static int readBit(uintptr_t reg) {
+  reg >>= 2;
+  if (reg < 20) {
+    return reg;
+  }
+  return (reg <= 21) ? 20 : -1;
+}
+
+// Returns the bit for writing the specified register, or -1 if writes to it
+// are discarded.
+static int writeBit(uintptr_t reg) {
+  reg >>= 2;
+  if (reg < 20) {
+    return reg;
+  }
+  return (reg == 21) ? 20 : -1;
+}
+
+static int isRegister(uintptr_t val) {
+  return (val & 3) == 3;
+}
+
+static int isLiteral(uintptr_t val) {
+  return (val & 3) == 1;
+}
+
+static int literalValue(uintptr_t val) {
+  return (int)((intptr_t)val >> 2);
+}
+
+static uintptr_t literal(int value) {
+  return ((uintptr_t)(intptr_t)value << 2) | 1;
+}
+
+// Returns k if value is 2^k (for k between 1 and 15), or 0 otherwise.
+static int powerOfTwo(int value) {
+  for (int k=1 ; k<16 ; k++) {
+    if (value == (1 << k)) {
+      return k;
+    }
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Constant propagation and folding
+////////////////////////////////////////////////////////////////////////////////
+
+// The registers whose values are known at a point in the program.
+struct constants {
+  uint32_t known;
+  int16_t value[21];
+};
+
+// Returns the mask of registers that the statements in a list may write.
+static uint32_t writes(struct ASTNode **list, uintptr_t count) {
+  uint32_t mask = 0;
+  for (uintptr_t i=0 ; i<count ; i++) {
+    uintptr_t val = (uintptr_t)list[i];
+    if (val & 1) continue;
+    struct ASTNode *ast = list[i];
+    switch (ast->type) {
+      case NTNeighbours:
+      case NTReductions:
+        // Neighbours loops load a0 before each statement
+        mask |= A0 | writes((struct ASTNode**)ast->val[1], ast->val[0]);
+        break;
+      case NTRangeMap:
+        break;
+      default: {
+        int bit = writeBit(ast->val[0]);
+        if (bit >= 0) {
+          mask |= 1 << bit;
+        }
+      }
+    }
+  }
+  return mask;
+}
+
+// Folds an expression, replacing registers with known values by literals and
+// range maps with known keys by the arm that they select.
+static uintptr_t foldExpression(uintptr_t val, struct constants *c) {
+  if (isRegister(val)) {
+    int bit = readBit(val);
+    if (bit < 0) {
+      return literal(-1);
+    }
+    return (c->known & (1 << bit)) ? literal(c->value[bit]) : val;
+  }
+  if (val & 1) {
+    return val;
+  }
+  struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)val)->val[0];
+  int bit = readBit(rm->value);
+  if ((bit >= 0) && (c->known & (1 << bit))) {
+    int key = c->value[bit];
+    for (int i=0 ; i<rm->count ; i++) {
+      struct RangeMapEntry *re = &rm->entries[i];
+      if ((key >= (re->min >> 2)) && (key <= (re->max >> 2))) {
+        return foldExpression(re->val, c);
+      }
+    }
+    return literal(0);
+  }
+  for (int i=0 ; i<rm->count ; i++) {
+    rm->entries[i].val = foldExpression(rm->entries[i].val, c);
+  }
+  return val;
+}
+
+// Evaluates an operation on two known values.  Returns 0 if the operation
+// can't be evaluated at compile time.
+static int evaluate(int type, int l, int r, int *result) {
+  switch (type) {
+    case NTOperatorAdd: *result = l + r; break;
+    case NTOperatorSub: *result = l - r; break;
+    case NTOperatorMul: *result = l * r; break;
+    case NTOperatorDiv:
+      // Leave division by zero for run time
+      if (r == 0) {
+        return 0;
+      }
+      *result = l / r;
+      break;
+    case NTOperatorAssign: *result = r; break;
+    case NTOperatorMin: *result = (r > l) ? l : r; break;
+    case NTOperatorMax: *result = (r < l) ? l : r; break;
+    case NTOperatorShl: *result = (int)((unsigned)l << r); break;
+    case NTOperatorShr:
+      *result = (l + ((l >> 31) & ((1 << r) - 1))) >> r;
+      break;
+    default:
+      return 0;
+  }
+  *result = (int16_t)*result;
+  return 1;
+}
+
+// Folds a statement.  Returns 0 if the statement does nothing and can be
+// removed.
+static int foldStatement(struct ASTNode *ast, struct constants *c);
+
+// Folds a list of statements, removing any that do nothing.  In the body of a
+// neighbours loop, a0 holds an unknown value at the start of each statement.
+// Returns the new number of statements.
+static uintptr_t foldList(struct ASTNode **list, uintptr_t count,
+                          struct constants *c, int isLoopBody)
+{
+  uintptr_t kept = 0;
+  for (uintptr_t i=0 ; i<count ; i++) {
+    if (isLoopBody) {
+      c->known &= ~A0;
+    }
+    // Bare literals and registers don't do anything.  The last statement of
+    // a loop body is kept anyway, because the neighbour value that is loaded
+    // before it is still in a0 when the loop exits.
+    if ((uintptr_t)list[i] & 1) {
+      if (isLoopBody && (i == count - 1)) {
+        list[kept++] = list[i];
+      }
+      continue;
+    }
+    if (foldStatement(list[i], c) || (isLoopBody && (i == count - 1))) {
+      list[kept++] = list[i];
+    }
+  }
+  return kept;
+}
+
+static int foldStatement(struct ASTNode *ast, struct constants *c) {
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions: {
+      // Anything that the loop writes, including a0, has an unknown value at
+      // the start of each iteration and after the loop.
+      struct ASTNode **body = (struct ASTNode**)ast->val[1];
+      c->known &= ~(A0 | writes(body, ast->val[0]));
+      struct constants inLoop = *c;
+      ast->val[0] = foldList(body, ast->val[0], &inLoop, 1);
+      return ast->val[0] != 0;
+    }
+    // Range expressions have no side effects
+    case NTRangeMap:
+      return 0;
+    default:
+      break;
+  }
+  int bit = writeBit(ast->val[0]);
+  if (bit < 0) {
+    return 0;
+  }
+  uint32_t mask = 1 << bit;
+  uintptr_t rhs = ast->val[1] = foldExpression(ast->val[1], c);
+  int known = (c->known & mask) != 0;
+  int l = c->value[bit];
+  c->known &= ~mask;
+  if (isLiteral(rhs)) {
+    int r = literalValue(rhs);
+    int result;
+    if ((known || (ast->type == NTOperatorAssign)) &&
+        evaluate(ast->type, l, r, &result)) {
+      ast->type = NTOperatorAssign;
+      ast->val[1] = literal(result);
+      c->known |= mask;
+      c->value[bit] = result;
+      return 1;
+    }
+    // Identity operations
+    if ((r == 0) && ((ast->type == NTOperatorAdd) ||
+                     (ast->type == NTOperatorSub))) {
+      c->known |= known ? mask : 0;
+      return 0;
+    }
+    if ((r == 1) && ((ast->type == NTOperatorMul) ||
+                     (ast->type == NTOperatorDiv))) {
+      c->known |= known ? mask : 0;
+      return 0;
+    }
+    if ((r == 0) && (ast->type == NTOperatorMul)) {
+      ast->type = NTOperatorAssign;
+      c->known |= mask;
+      c->value[bit] = 0;
+      return 1;
+    }
+    // Strength reduction
+    int shift = powerOfTwo(r);
+    if (shift && (ast->type == NTOperatorMul)) {
+      ast->type = NTOperatorShl;
+      ast->val[1] = literal(shift);
+    } else if (shift && (ast->type == NTOperatorDiv)) {
+      ast->type = NTOperatorShr;
+      ast->val[1] = literal(shift);
+    }
+    return 1;
+  }
+  // Operations on a register that is known to be zero
+  if (known && (l == 0)) {
+    if (ast->type == NTOperatorAdd) {
+      ast->type = NTOperatorAssign;
+    } else if (ast->type == NTOperatorMul) {
+      ast->type = NTOperatorAssign;
+      ast->val[1] = literal(0);
+      c->known |= mask;
+      c->value[bit] = 0;
+    }
+  }
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Liveness and dead store elimination
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns the mask of registers that an expression reads.
+static uint32_t uses(uintptr_t val) {
+  if (isRegister(val)) {
+    int bit = readBit(val);
+    return (bit < 0) ? 0 : 1 << bit;
+  }
+  if (val & 1) {
+    return 0;
+  }
+  struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)val)->val[0];
+  uint32_t mask = uses(rm->value);
+  for (int i=0 ; i<rm->count ; i++) {
+    mask |= uses(rm->entries[i].val);
+  }
+  return mask;
+}
+
+static uint32_t liveList(struct ASTNode **list, uintptr_t *count,
+                         uint32_t live, int isLoopBody, int keepLast,
+                         int removeDead);
+static void recogniseReductions(struct ASTNode *ast);
+
+// Computes the registers that are live before a statement, given those that
+// are live after it.  Sets *dead if the statement has no effect.  If
+// removeDead is set, dead statements in the bodies of loops are removed.
+static uint32_t liveStatement(uintptr_t val, uint32_t live, int keep,
+                              int removeDead, int *dead)
+{
+  *dead = 0;
+  if (val & 1) {
+    *dead = !keep;
+    return live;
+  }
+  struct ASTNode *ast = (struct ASTNode*)val;
+  switch (ast->type) {
+    case NTNeighbours:
+    case NTReductions: {
+      struct ASTNode **body = (struct ASTNode**)ast->val[1];
+      // If a0 is live after the loop, it holds the last neighbour, which was
+      // loaded before the last statement of the body, so that statement
+      // must stay.
+      int keepLast = (live & A0) != 0;
+      // The loop may run any number of times, so iterate until the set of
+      // registers live at the top of the loop stops changing.
+      uint32_t loop = live;
+      for (;;) {
+        uintptr_t count = ast->val[0];
+        uint32_t next =
+          live | liveList(body, &count, loop, 1, keepLast, 0);
+        if (next == loop) {
+          break;
+        }
+        loop = next;
+      }
+      if (removeDead) {
+        uintptr_t count = ast->val[0];
+        liveList(body, &count, loop, 1, keepLast, 1);
+        ast->val[0] = count;
+        // Reductions leave the last neighbour in a0, so they can only be
+        // reordered if nothing reads it after the loop.
+        if (!keepLast && (ast->type == NTNeighbours)) {
+          recogniseReductions(ast);
+        }
+      }
+      *dead = !keep && (ast->val[0] == 0);
+      return loop;
+    }
+    case NTRangeMap:
+      *dead = !keep;
+      return keep ? live | uses(val) : live;
+    default:
+      break;
+  }
+  // Writes to registers that aren't read again are dead
+  int bit = writeBit(ast->val[0]);
+  if (!keep && ((bit < 0) || !(live & (1 << bit)))) {
+    *dead = 1;
+    return live;
+  }
+  if (bit >= 0) {
+    if (ast->type == NTOperatorAssign) {
+      live &= ~(1 << bit);
+    } else {
+      live |= 1 << bit;
+    }
+  }
+  return live | uses(ast->val[1]);
+}
+
+// Computes the registers that are live before a list of statements, given
+// those that are live after it.  In loop bodies, a0 is loaded before every
+// statement, so it is never live across the boundary between two statements.
+// If removeDead is set, dead statements are removed from the list and *count
+// is updated.
+static uint32_t liveList(struct ASTNode **list, uintptr_t *count,
+                         uint32_t live, int isLoopBody, int keepLast,
+                         int removeDead)
+{
+  uintptr_t n = *count;
+  char *dead = calloc(n + 1, 1);
+  for (uintptr_t i=n ; i>0 ; i--) {
+    int isDead;
+    live = liveStatement((uintptr_t)list[i-1], live, keepLast && (i == n),
+                         removeDead, &isDead);
+    dead[i-1] = isDead;
+    if (isLoopBody) {
+      live &= ~A0;
+    }
+  }
+  if (removeDead) {
+    uintptr_t kept = 0;
+    for (uintptr_t i=0 ; i<n ; i++) {
+      if (!dead[i]) {
+        list[kept++] = list[i];
+      }
+    }
+    *count = kept;
+  }
+  free(dead);
+  return live;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reduction recognition
+////////////////////////////////////////////////////////////////////////////////
+
+static int isA0(uintptr_t val) {
+  return isRegister(val) && (readBit(val) == 0);
+}
+
+// Returns whether an expression is a range map over a0 with only literal
+// arms, which counts (or weights) the neighbours that fall into each range.
+static int isCountingMap(uintptr_t val) {
+  if (val & 1) {
+    return 0;
+  }
+  struct RangeMap *rm = (struct RangeMap*)((struct ASTNode*)val)->val[0];
+  if (!isA0(rm->value)) {
+    return 0;
+  }
+  for (int i=0 ; i<rm->count ; i++) {
+    if (!isLiteral(rm->entries[i].val)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Returns the reduction that a statement in the body of a neighbours loop
+// performs, or -1 if it isn't one.
+static int reductionType(struct ASTNode *ast) {
+  if ((uintptr_t)ast & 1) {
+    return -1;
+  }
+  // Reductions into a0 would be overwritten by the next neighbour
+  int bit = writeBit(ast->val[0]);
+  if (bit <= 0) {
+    return -1;
+  }
+  uintptr_t arg = ast->val[1];
+  switch (ast->type) {
+    case NTOperatorAdd:
+      if (isA0(arg)) {
+        return NTReduceSum;
+      }
+      return (isLiteral(arg) || isCountingMap(arg)) ? NTReduceCount : -1;
+    case NTOperatorMin:
+      return isA0(arg) ? NTReduceMin : -1;
+    case NTOperatorMax:
+      return isA0(arg) ? NTReduceMax : -1;
+    default:
+      return -1;
+  }
+}
+
+// Turns a neighbours loop into an NTReductions node if every statement in its
+// body is a reduction into a different register.  Each statement then only
+// depends on a0 and its own register, so the back ends are free to evaluate
+// them one at a time, in any order.
+static void recogniseReductions(struct ASTNode *ast) {
+  struct ASTNode **body = (struct ASTNode**)ast->val[1];
+  uint32_t seen = 0;
+  if (ast->val[0] == 0) {
+    return;
+  }
+  for (uintptr_t i=0 ; i<ast->val[0] ; i++) {
+    if (reductionType(body[i]) < 0) {
+      return;
+    }
+    uint32_t mask = 1 << writeBit(body[i]->val[0]);
+    if (seen & mask) {
+      return;
+    }
+    seen |= mask;
+  }
+  for (uintptr_t i=0 ; i<ast->val[0] ; i++) {
+    body[i]->type = reductionType(body[i]);
+  }
+  ast->type = NTReductions;
+}
+
+// The registers that are still needed after the last statement: the global
+// registers persist to the next cell and v is the cell's new value.
+static const uint32_t LiveOut = GlobalRegisters | ValueRegister;
+
+uintptr_t optimiseAST(struct ASTNode **ast, uintptr_t count) {
+  // The local registers start at zero, but nothing is known about the global
+  // registers or the cell's value.
+  struct constants c = { LocalRegisters, {0} };
+  count = foldList(ast, count, &c, 0);
+  liveList(ast, &count, LiveOut, 0, 0, 1);
+  return count;
+}
+
+uint16_t liveLocalRegisters(struct ASTNode **ast, uintptr_t count) {
+  return liveList(ast, &count, LiveOut, 0, 0, 0) & LocalRegisters;
+}
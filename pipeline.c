@@ -0,0 +1,83 @@
+#include "AST.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Wavefront pipelining.  Splitting each generation into one band of rows per
+// thread needs a barrier at the end of every generation, which costs more
+// than the work itself when the grid is narrow.  Instead, each thread
+// computes a whole generation: with n threads, generation g is computed by
+// thread g % n, a few rows behind the thread computing generation g - 1.
+// Rows are handed from one thread to the next while they are still in the
+// cache, and the only synchronisation is a progress counter per thread.
+//
+// Only two grids are needed.  Computing row x of a generation overwrites row
+// x of the generation two before it, which is safe as long as the previous
+// generation has already finished row x + 1, the last one that reads it.
+// That is also exactly the condition for the rows needed to compute row x to
+// be ready, so each thread only ever waits for its predecessor.
+
+// The number of rows that each thread computes between updates of its
+// progress counter
+static const int PipelineRows = 4;
+
+struct pipelineStep {
+  int16_t *grids[2];
+  int16_t width;
+  int16_t height;
+  int generations;
+  int stages;
+  kernelFn fn;
+  void *program;
+  // The number of rows that each stage has finished, counting every
+  // generation it has computed so far, so that the counters never go
+  // backwards.
+  int64_t *progress;
+};
+
+// Spins until the counter reaches at least the specified value.
+static void waitForProgress(int64_t *counter, int64_t value) {
+  for (int spins=0 ; __atomic_load_n(counter, __ATOMIC_ACQUIRE) < value ; spins++) {
+    spinPause(spins);
+  }
+}
+
+// Runs stage number stageBegin of the pipeline.  Each band of the thread pool
+// is a single stage, and every stage waits for the one before it, so this
+// relies on runInBands() running all of the bands at once.
+static void runStage(void *context, int16_t stageBegin, int16_t stageEnd) {
+  assert(stageEnd == stageBegin + 1);
+  struct pipelineStep *step = context;
+  int stage = stageBegin;
+  int stages = step->stages;
+  int width = step->width;
+  for (int g=stage ; g<step->generations ; g+=stages) {
+    // The predecessor's counter, and its value when it started generation
+    // g - 1.
+    int64_t *previous = &step->progress[(g + stages - 1) % stages];
+    int64_t previousBase = (int64_t)((g - 1) / stages) * width;
+    int64_t base = (int64_t)(g / stages) * width;
+    for (int x=0 ; x<width ; x+=PipelineRows) {
+      int end = (x + PipelineRows < width) ? x + PipelineRows : width;
+      if (g > 0) {
+        int needed = (end + 1 < width) ? end + 1 : width;
+        waitForProgress(previous, previousBase + needed);
+      }
+      step->fn(step->program, step->grids[g & 1], step->grids[(g + 1) & 1],
+               step->width, step->height, x, end, 0, step->height);
+      __atomic_store_n(&step->progress[stage], base + end, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+void runPipelined(int16_t *oldgrid, int16_t *newgrid, int16_t width,
+                  int16_t height, int generations, kernelFn fn, void *program,
+                  struct threadPool *pool)
+{
+  int stages = threadPoolSize(pool);
+  struct pipelineStep step = { { oldgrid, newgrid }, width, height,
+                               generations, stages, fn, program,
+                               calloc(stages, sizeof(int64_t)) };
+  runInBands(pool, stages, runStage, &step);
+  free(step.progress);
+}
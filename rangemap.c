@@ -0,0 +1,84 @@
+#include "interpreter.h"
+#include <stdlib.h>
+
+// Preprocessing of range maps for the interpreters.  Range maps are ordered
+// lists of (possibly overlapping) ranges, where the first one that matches
+// wins.  Machine-generated rules can have hundreds of arms, so rather than
+// scanning them for every cell, they are flattened into either a table
+// indexed directly by the key or a sorted list of disjoint intervals.
+
+// Range maps whose keys span at most this many values get a direct table.
+static const int DirectTableLimit = 256;
+
+static int compareIntervals(const void *a, const void *b) {
+  const struct rangeInterval *l = a;
+  const struct rangeInterval *r = b;
+  return (l->min > r->min) - (l->min < r->min);
+}
+
+// Adds the parts of [min, max] that aren't already claimed by an earlier arm
+// to the list of intervals, which is kept sorted.
+static void claim(struct rangeLookup *l, int min, int max, int arm) {
+  int count = l->count;
+  for (int i=0 ; (i<count) && (min <= max) ; i++) {
+    struct rangeInterval *r = &l->intervals[i];
+    if (r->max < min) continue;
+    if (r->min > max) break;
+    // Add the gap before this interval, then skip over it.
+    if (min < r->min) {
+      l->intervals[l->count++] = (struct rangeInterval){ min, r->min - 1, arm };
+    }
+    min = r->max + 1;
+  }
+  if (min <= max) {
+    l->intervals[l->count++] = (struct rangeInterval){ min, max, arm };
+  }
+  qsort(l->intervals, l->count, sizeof(struct rangeInterval), compareIntervals);
+}
+
+struct rangeLookup *buildRangeLookup(struct RangeMap *rm) {
+  struct rangeLookup *l = calloc(1, sizeof(struct rangeLookup));
+  // Each arm can at most fill in the gaps between the existing intervals,
+  // so there are never more than 2n intervals.
+  l->intervals = calloc(2 * rm->count + 1, sizeof(struct rangeInterval));
+  for (int i=0 ; i<rm->count ; i++) {
+    struct RangeMapEntry *re = &rm->entries[i];
+    intptr_t min = re->min >> 2;
+    intptr_t max = re->max >> 2;
+    // Keys are 16-bit registers, so some arms can never match.
+    if ((min > INT16_MAX) || (min > max)) continue;
+    if (max > INT16_MAX) max = INT16_MAX;
+    claim(l, min, max, i);
+  }
+  // Merge adjacent intervals that lead to the same arm.
+  int merged = 0;
+  for (int i=0 ; i<l->count ; i++) {
+    if ((merged > 0) && (l->intervals[merged-1].arm == l->intervals[i].arm) &&
+        (l->intervals[merged-1].max + 1 == l->intervals[i].min)) {
+      l->intervals[merged-1].max = l->intervals[i].max;
+    } else {
+      l->intervals[merged++] = l->intervals[i];
+    }
+  }
+  l->count = merged;
+  if (merged == 0) {
+    return l;
+  }
+  int lowest = l->intervals[0].min;
+  int highest = l->intervals[merged-1].max;
+  if ((highest - lowest < DirectTableLimit) && (rm->count <= INT16_MAX)) {
+    l->lowest = lowest;
+    l->size = highest - lowest + 1;
+    l->table = malloc(l->size * sizeof(int16_t));
+    for (int i=0 ; i<l->size ; i++) {
+      l->table[i] = -1;
+    }
+    for (int i=0 ; i<merged ; i++) {
+      struct rangeInterval *r = &l->intervals[i];
+      for (int key=r->min ; key<=r->max ; key++) {
+        l->table[key - lowest] = r->arm;
+      }
+    }
+  }
+  return l;
+}
@@ -0,0 +1,260 @@
+#include "AST.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A table-driven engine for outer totalistic programs.  The new value of each
+// cell in such a program depends only on its old value and on the sum of its
+// neighbours, so the program can be run once for every combination up front,
+// and each generation is then just a neighbour sum and a table lookup per
+// cell.
+//
+// The table has to cover every value that a cell can ever hold.  Cells start
+// with values between 0 and the maximum in the initial grid, but the program
+// may produce larger ones, so the set of states is grown until the program
+// maps it into itself.  Programs that produce negative values, or too many
+// states, aren't worth tabulating.
+
+// The largest state that the table can hold
+static const int MaxState = 127;
+
+struct ruleTable {
+  // States are 0 to maxState
+  int maxState;
+  // The number of possible neighbour sums, 0 to 8 * maxState
+  int sums;
+  // The new value, indexed by old value * sums + neighbour sum
+  int16_t *next;
+};
+
+// The arguments for running one generation
+struct tableStep {
+  struct ruleTable *table;
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  int16_t width;
+  int16_t height;
+};
+
+// Runs the program for every state and neighbour sum up to maxState, filling
+// in the table.  Returns the largest value produced, or -1 if any of them is
+// negative.
+static int fillTable(struct ruleTable *t, struct bytecode *code) {
+  // The program can only see the sum of the neighbours, so the whole sum can
+  // go in a single neighbour.
+  struct neighbourhood n = { 8, { -4, -3, -2, -1, 1, 2, 3, 4 } };
+  int highest = 0;
+  for (int v=0 ; v<=t->maxState ; v++) {
+    for (int sum=0 ; sum<t->sums ; sum++) {
+      int16_t block[9] = {0};
+      block[4] = v;
+      block[0] = sum;
+      int16_t result = interpretCell(code, &block[4], &n);
+      if (result < 0) {
+        return -1;
+      }
+      if (result > highest) {
+        highest = result;
+      }
+      t->next[v * t->sums + sum] = result;
+    }
+  }
+  return highest;
+}
+
+struct ruleTable *createRuleTable(struct bytecode *code, int maxValue) {
+  struct ruleTable *t = calloc(1, sizeof(struct ruleTable));
+  t->maxState = maxValue;
+  while (t->maxState <= MaxState) {
+    t->sums = 8 * t->maxState + 1;
+    t->next = realloc(t->next, (t->maxState + 1) * t->sums * sizeof(int16_t));
+    int highest = fillTable(t, code);
+    if (highest < 0) {
+      break;
+    }
+    if (highest <= t->maxState) {
+      return t;
+    }
+    t->maxState = highest;
+  }
+  destroyRuleTable(t);
+  return NULL;
+}
+
+void destroyRuleTable(struct ruleTable *t) {
+  if (t == NULL) {
+    return;
+  }
+  free(t->next);
+  free(t);
+}
+
+// Halo cells are always zero, so they don't change the sum, and cells on the
+// edges need no special treatment.
+static void runTableRegion(void *context, int16_t xBegin, int16_t xEnd,
+                           int16_t yBegin, int16_t yEnd)
+{
+  struct tableStep *step = context;
+  const int16_t *next = step->table->next;
+  int sums = step->table->sums;
+  int stride = gridStride(step->height);
+  for (int x=xBegin ; x<xEnd ; x++) {
+    int i = gridIndex(x, yBegin, step->height);
+    const int16_t *old = step->oldgrid;
+    for (int y=yBegin ; y<yEnd ; y++,i++) {
+      int sum = old[i-stride-1] + old[i-stride] + old[i-stride+1] +
+                old[i-1] + old[i+1] +
+                old[i+stride-1] + old[i+stride] + old[i+stride+1];
+      step->newgrid[i] = next[old[i] * sums + sum];
+    }
+  }
+}
+
+static void runTableRows(void *context, int16_t rowBegin, int16_t rowEnd) {
+  struct tableStep *step = context;
+  runTableRegion(context, rowBegin, rowEnd, 0, step->height);
+}
+
+void runRuleTable(int16_t *oldgrid, int16_t *newgrid, int16_t width,
+                  int16_t height, struct ruleTable *table,
+                  struct threadPool *pool, struct tileGrid *tiles)
+{
+  struct tableStep step = { table, oldgrid, newgrid, width, height };
+  if (tiles) {
+    runTiles(tiles, oldgrid, newgrid, runTableRegion, &step, pool);
+  } else {
+    runInBands(pool, width, runTableRows, &step);
+  }
+}
+
+// Incremental updates.  On grids where most cells are stable, recomputing
+// every cell each generation is wasted work.  Instead, the sum of each cell's
+// neighbours is stored, along with a list of the cells whose value or sum
+// changed in the last generation.  Only those cells can change in the next
+// one, and each cell that does change adjusts the sums of its neighbours, so
+// the cost of a generation depends on the number of changes rather than on
+// the size of the grid.
+
+// Values in the candidate marks
+enum { NotCandidate, Candidate, Halo };
+
+struct incrementalGrid {
+  struct ruleTable *table;
+  int16_t width;
+  int16_t height;
+  // The cells, in the usual layout
+  int16_t *cells;
+  // The sum of each cell's neighbours
+  int *sums;
+  // The offsets of the eight neighbours
+  int offsets[8];
+  // The cells that may change in the next generation, and a mark for each
+  // cell saying whether it is already in the list.  Halo cells are never
+  // candidates.
+  int *candidates;
+  int candidateCount;
+  uint8_t *marks;
+  // The cells that changed in this generation, and their new values
+  int *changed;
+  int16_t *changedValues;
+};
+
+static inline void addCandidate(struct incrementalGrid *inc, int i) {
+  if (inc->marks[i] == NotCandidate) {
+    inc->marks[i] = Candidate;
+    inc->candidates[inc->candidateCount++] = i;
+  }
+}
+
+struct incrementalGrid *createIncrementalGrid(struct ruleTable *table,
+                                              int16_t *grid, int16_t width,
+                                              int16_t height)
+{
+  struct incrementalGrid *inc = calloc(1, sizeof(struct incrementalGrid));
+  int cells = gridCells(width, height);
+  int stride = gridStride(height);
+  inc->table = table;
+  inc->width = width;
+  inc->height = height;
+  inc->cells = calloc(cells, sizeof(int16_t));
+  inc->sums = calloc(cells, sizeof(int));
+  inc->candidates = calloc(cells, sizeof(int));
+  inc->marks = malloc(cells);
+  inc->changed = calloc(cells, sizeof(int));
+  inc->changedValues = calloc(cells, sizeof(int16_t));
+  int k = 0;
+  for (int dx=-1 ; dx<=1 ; dx++) {
+    for (int dy=-1 ; dy<=1 ; dy++) {
+      if (dx == 0 && dy == 0) continue;
+      inc->offsets[k++] = dx * stride + dy;
+    }
+  }
+  memset(inc->marks, Halo, cells);
+  for (int x=0 ; x<width ; x++) {
+    for (int y=0 ; y<height ; y++) {
+      int i = gridIndex(x, y, height);
+      inc->cells[i] = grid[i];
+      inc->marks[i] = NotCandidate;
+    }
+  }
+  // Every cell is a candidate in the first generation
+  for (int x=0 ; x<width ; x++) {
+    for (int y=0 ; y<height ; y++) {
+      int i = gridIndex(x, y, height);
+      for (int n=0 ; n<8 ; n++) {
+        inc->sums[i] += inc->cells[i + inc->offsets[n]];
+      }
+      addCandidate(inc, i);
+    }
+  }
+  return inc;
+}
+
+void destroyIncrementalGrid(struct incrementalGrid *inc) {
+  if (inc == NULL) {
+    return;
+  }
+  free(inc->cells);
+  free(inc->sums);
+  free(inc->candidates);
+  free(inc->marks);
+  free(inc->changed);
+  free(inc->changedValues);
+  free(inc);
+}
+
+void runIncrementalGrid(struct incrementalGrid *inc, int generations) {
+  const int16_t *next = inc->table->next;
+  int sums = inc->table->sums;
+  for (int g=0 ; g<generations ; g++) {
+    // Find the new values of the candidates, all from the old state
+    int changedCount = 0;
+    for (int c=0 ; c<inc->candidateCount ; c++) {
+      int i = inc->candidates[c];
+      int16_t v = next[inc->cells[i] * sums + inc->sums[i]];
+      inc->marks[i] = NotCandidate;
+      if (v != inc->cells[i]) {
+        inc->changed[changedCount] = i;
+        inc->changedValues[changedCount++] = v;
+      }
+    }
+    // Then apply the changes, which gives the candidates for the next
+    // generation.
+    inc->candidateCount = 0;
+    for (int c=0 ; c<changedCount ; c++) {
+      int i = inc->changed[c];
+      int delta = inc->changedValues[c] - inc->cells[i];
+      inc->cells[i] = inc->changedValues[c];
+      addCandidate(inc, i);
+      for (int k=0 ; k<8 ; k++) {
+        int n = i + inc->offsets[k];
+        inc->sums[n] += delta;
+        addCandidate(inc, n);
+      }
+    }
+  }
+}
+
+void readIncrementalGrid(struct incrementalGrid *inc, int16_t *grid) {
+  memcpy(grid, inc->cells,
+         gridCells(inc->width, inc->height) * sizeof(int16_t));
+}
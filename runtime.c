@@ -1,15 +1,113 @@
 #include <stdint.h>
+#include "grid.h"
 
-// Prototype.  The real function will be inserted by the JIT.
-int16_t cell(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t x, int16_t y, int16_t v, int16_t *g);
+// Prototype.  The real function will be inserted by the JIT.  here points to
+// the cell in oldgrid, and neighbours holds the offsets from it of the count
+// neighbours that are inside the grid.
+int16_t cell(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t x, int16_t y, int16_t v, int16_t *g, int16_t *here, const int *neighbours, int count);
+// Prototype for the version of cell() that is only called for cells that have
+// all eight neighbours.  These are stride apart in adjacent rows.  If
+// sumNeighbours is set, neighbourSum is the sum of the eight neighbours.
+int16_t cellInterior(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t height, int16_t x, int16_t y, int16_t v, int16_t *g, int16_t *here, int stride, int neighbourSum);
+// Set by the JIT if the program adds up the neighbours of interior cells.
+extern const int sumNeighbours;
+
+// The sum of the cell at p and the cells above and below it
+static inline int columnSum(const int16_t *p, int stride) {
+  return p[-stride] + p[0] + p[stride];
+}
+
+// Runs the cell function for a cell on the edge of the grid
+static inline void borderCell(int16_t *oldgrid, int16_t *newgrid, int16_t
+    width, int16_t height, int16_t x, int16_t y, int16_t *g,
+    struct neighbourhood *n) {
+  int i = gridIndex(x, y, height);
+  struct neighbourhood *nc = &n[neighbourClass(x, y, width, height)];
+  newgrid[i] = cell(oldgrid, newgrid, width, height, x, y, oldgrid[i], g,
+      &oldgrid[i], nc->offsets, nc->count);
+}
+
+// Runs the cells in rows [xBegin, xEnd) and columns [yBegin, yEnd) of one
+// generation.  Separate calls touch disjoint parts of newgrid, so regions can
+// be run in parallel as long as the program doesn't use the global registers.
+void automatonRegion(int16_t *oldgrid, int16_t *newgrid, int16_t width,
+    int16_t height, int16_t xBegin, int16_t xEnd, int16_t yBegin, int16_t
+    yEnd) {
+  int16_t g[10] = {0};
+  int stride = gridStride(height);
+  struct neighbourhood n[16];
+  buildNeighbourhoods(n, height);
+  int16_t interiorBegin = yBegin > 1 ? yBegin : 1;
+  int16_t interiorEnd = yEnd < height-1 ? yEnd : height-1;
+  for (int16_t x=xBegin ; x<xEnd ; x++) {
+    // The first and last rows are entirely on the border
+    if (x == 0 || x == width - 1) {
+      for (int16_t y=yBegin ; y<yEnd ; y++) {
+        borderCell(oldgrid, newgrid, width, height, x, y, g, n);
+      }
+      continue;
+    }
+    // Other rows have a border cell at each end, and interior cells between
+    if (yBegin == 0) {
+      borderCell(oldgrid, newgrid, width, height, x, 0, g, n);
+    }
+    int i = gridIndex(x, interiorBegin, height);
+    if (sumNeighbours) {
+      // Keep a running window of three column sums while sweeping along the
+      // row, so that each cell only needs the new column on its right.
+      int left = columnSum(&oldgrid[i-1], stride);
+      int centre = columnSum(&oldgrid[i], stride);
+      for (int16_t y=interiorBegin ; y<interiorEnd ; y++,i++) {
+        int right = columnSum(&oldgrid[i+1], stride);
+        newgrid[i] = cellInterior(oldgrid, newgrid, width, height, x, y,
+            oldgrid[i], g, &oldgrid[i], stride,
+            left + centre + right - oldgrid[i]);
+        left = centre;
+        centre = right;
+      }
+    } else {
+      for (int16_t y=interiorBegin ; y<interiorEnd ; y++,i++) {
+        newgrid[i] = cellInterior(oldgrid, newgrid, width, height, x, y,
+            oldgrid[i], g, &oldgrid[i], stride, 0);
+      }
+    }
+    if ((yEnd == height) && (height > 1)) {
+      borderCell(oldgrid, newgrid, width, height, x, height-1, g, n);
+    }
+  }
+}
+
+// Runs the rows [rowBegin, rowEnd) of one generation.
+void automatonRows(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t
+    height, int16_t rowBegin, int16_t rowEnd) {
+  automatonRegion(oldgrid, newgrid, width, height, rowBegin, rowEnd, 0,
+      height);
+}
 
 void automaton(int16_t *oldgrid, int16_t *newgrid, int16_t width, int16_t
     height) {
-  int16_t g[10] = {0};
-  int16_t i=0;
-  for (int16_t x=0 ; x<width ; x++) {
-    for (int16_t y=0 ; y<height ; y++,i++) {
-      newgrid[i] = cell(oldgrid, newgrid, width, height, x, y, oldgrid[i], g);
+  automatonRows(oldgrid, newgrid, width, height, 0, width);
+}
+
+// Prototype for the bit-packed version of a two-state outer totalistic rule,
+// which computes 64 cells at once.  Each argument holds the neighbours in one
+// direction of the cells in c, which is the middle word.
+uint64_t bitCell(uint64_t nw, uint64_t n, uint64_t ne, uint64_t w, uint64_t c,
+    uint64_t e, uint64_t sw, uint64_t s, uint64_t se);
+
+// Runs the rows [rowBegin, rowEnd) of one generation of a bit-packed grid.
+void bitAutomatonRows(uint64_t *rows, uint64_t *next, int16_t width, int
+    words, uint64_t tailMask, int16_t rowBegin, int16_t rowEnd) {
+  for (int x=rowBegin ; x<rowEnd ; x++) {
+    const uint64_t *above = &rows[x * words];
+    const uint64_t *row = &rows[(x + 1) * words];
+    const uint64_t *below = &rows[(x + 2) * words];
+    uint64_t *out = &next[(x + 1) * words];
+    for (int i=0 ; i<words ; i++) {
+      out[i] = bitCell(bitWest(above, i), above[i], bitEast(above, i, words),
+          bitWest(row, i), row[i], bitEast(row, i, words),
+          bitWest(below, i), below[i], bitEast(below, i, words));
     }
+    out[words-1] &= tailMask;
   }
 }
@@ -0,0 +1,122 @@
+#include "AST.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+// A pool of worker threads that persists for the whole run.  Each generation,
+// the thread that calls runInBands() publishes the work and bumps the
+// generation counter, every thread (including the caller) runs its own band
+// of rows, and the caller then waits for the others to finish.  Both waits
+// spin on a shared counter, which is much cheaper than a mutex and condition
+// variable when generations are short.
+
+struct threadPool {
+  // The number of threads, including the one calling runInBands()
+  int threads;
+  // The worker threads
+  pthread_t *workers;
+  // The work for the current generation
+  bandFn fn;
+  void *context;
+  int16_t rows;
+  // Incremented once per generation to release the workers
+  unsigned generation;
+  // The number of workers that have not yet finished this generation
+  int running;
+};
+
+// The arguments passed to each worker thread
+struct worker {
+  struct threadPool *pool;
+  int index;
+};
+
+void spinPause(int spins) {
+  // Yielding after a while lets oversubscribed machines still make progress
+  if (spins > 1000) {
+    sched_yield();
+  }
+}
+
+// Spins until the specified word stops being equal to value.
+static void waitWhileEqual(unsigned *word, unsigned value) {
+  for (int spins=0 ; __atomic_load_n(word, __ATOMIC_ACQUIRE) == value ; spins++) {
+    spinPause(spins);
+  }
+}
+
+// Runs band number index of the current generation's work.
+static void runBand(struct threadPool *pool, int index) {
+  int16_t begin = (int)pool->rows * index / pool->threads;
+  int16_t end = (int)pool->rows * (index + 1) / pool->threads;
+  if (begin < end) {
+    pool->fn(pool->context, begin, end);
+  }
+}
+
+static void *workerThread(void *arg) {
+  struct worker *w = arg;
+  struct threadPool *pool = w->pool;
+  unsigned generation = 0;
+  for (;;) {
+    waitWhileEqual(&pool->generation, generation);
+    generation++;
+    // A NULL function tells the workers to exit
+    if (pool->fn == NULL) {
+      break;
+    }
+    runBand(pool, w->index);
+    __atomic_sub_fetch(&pool->running, 1, __ATOMIC_RELEASE);
+  }
+  free(w);
+  return NULL;
+}
+
+struct threadPool *createThreadPool(int threads) {
+  struct threadPool *pool = calloc(1, sizeof(struct threadPool));
+  pool->threads = threads;
+  pool->workers = calloc(threads, sizeof(pthread_t));
+  for (int i=1 ; i<threads ; i++) {
+    struct worker *w = malloc(sizeof(struct worker));
+    w->pool = pool;
+    w->index = i;
+    pthread_create(&pool->workers[i], NULL, workerThread, w);
+  }
+  return pool;
+}
+
+void destroyThreadPool(struct threadPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pool->fn = NULL;
+  __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+  for (int i=1 ; i<pool->threads ; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  free(pool->workers);
+  free(pool);
+}
+
+int threadPoolSize(struct threadPool *pool) {
+  return pool ? pool->threads : 1;
+}
+
+void runInBands(struct threadPool *pool, int16_t rows, bandFn fn, void *context) {
+  if (pool == NULL) {
+    fn(context, 0, rows);
+    return;
+  }
+  pool->fn = fn;
+  pool->context = context;
+  pool->rows = rows;
+  pool->running = pool->threads - 1;
+  __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+  runBand(pool, 0);
+  // Wait for everyone else to finish before the grids are swapped.
+  for (int spins=0 ; __atomic_load_n(&pool->running, __ATOMIC_ACQUIRE) != 0 ; spins++) {
+    if (spins > 1000) {
+      sched_yield();
+    }
+  }
+}
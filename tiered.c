@@ -0,0 +1,101 @@
+#include "AST.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Tiered execution.  Compiling a program takes long enough that short runs
+// spend most of their time waiting for it, so instead the program is
+// compiled on a background thread while the interpreter runs the first
+// generations.  The caller checks for a compiled version at the start of
+// each generation and switches to it as soon as it appears.  Nothing carries
+// over from one generation to the next except the grid, so switching between
+// generations doesn't change the results.
+//
+// The first tier is compiled without optimisation, because that is quickest
+// to produce.  If a higher optimisation level was asked for, the program is
+// then compiled again at that level, and the caller switches again when that
+// is ready.
+
+struct tieredCompiler {
+  struct ASTNode **ast;
+  uintptr_t count;
+  int optimiseLevel;
+  // The compiler, which is only used by the background thread
+  struct jitCompiler *jit;
+  // The tiers, in the order in which they are compiled
+  struct compiledAutomaton *tiers[2];
+  // The number of tiers that are ready.  Each tier is filled in before this
+  // is incremented, so the caller never sees a partial one.
+  int ready;
+  // Set when the caller no longer needs any more tiers
+  int cancelled;
+  // Set by whichever of the caller and the background thread is finished
+  // with the compiler first.  The other one then frees it.
+  int released;
+  pthread_t thread;
+};
+
+static void freeTiers(struct tieredCompiler *t) {
+  for (int i=0 ; i<t->ready ; i++) {
+    freeAutomaton(t->tiers[i]);
+  }
+  destroyJITCompiler(t->jit);
+  free(t);
+}
+
+static void *compileTiers(void *arg) {
+  struct tieredCompiler *t = arg;
+  int levels[2] = { 0, t->optimiseLevel };
+  int count = (t->optimiseLevel > 0) ? 2 : 1;
+  for (int i=0 ; i<count ; i++) {
+    if (__atomic_load_n(&t->cancelled, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    t->tiers[i] = compile(t->jit, t->ast, t->count, levels[i]);
+    __atomic_store_n(&t->ready, i + 1, __ATOMIC_RELEASE);
+  }
+  if (__atomic_exchange_n(&t->released, 1, __ATOMIC_ACQ_REL)) {
+    freeTiers(t);
+  }
+  return NULL;
+}
+
+struct tieredCompiler *startTieredCompiler(struct ASTNode **ast,
+                                           uintptr_t count, int optimiseLevel)
+{
+  struct tieredCompiler *t = calloc(1, sizeof(struct tieredCompiler));
+  t->ast = ast;
+  t->count = count;
+  t->optimiseLevel = optimiseLevel;
+  t->jit = createJITCompiler();
+  pthread_create(&t->thread, NULL, compileTiers, t);
+  return t;
+}
+
+int latestTier(struct tieredCompiler *t, automaton *ca, rowAutomaton *rows,
+               regionAutomaton *region)
+{
+  int ready = __atomic_load_n(&t->ready, __ATOMIC_ACQUIRE);
+  if (ready > 0) {
+    struct compiledAutomaton *tier = t->tiers[ready - 1];
+    *ca = tier->ca;
+    *rows = tier->rows;
+    *region = tier->region;
+  }
+  return ready;
+}
+
+int finishTieredCompiler(struct tieredCompiler *t) {
+  // There's no point starting another compile, but LLVM can't be
+  // interrupted, so one that has already started is left to finish in the
+  // background rather than making the caller wait for it.  The thread may
+  // free t as soon as it is released, so its handle is read first.
+  pthread_t thread = t->thread;
+  __atomic_store_n(&t->cancelled, 1, __ATOMIC_RELEASE);
+  if (!__atomic_exchange_n(&t->released, 1, __ATOMIC_ACQ_REL)) {
+    pthread_detach(thread);
+    return 1;
+  }
+  pthread_join(thread, NULL);
+  freeTiers(t);
+  return 0;
+}
@@ -0,0 +1,115 @@
+#include "AST.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Dirty tile tracking.  The grid is split into square tiles, and each
+// generation only the tiles that could have changed are recomputed: those
+// where the tile itself or one of its eight neighbouring tiles changed in the
+// previous generation.  Everything else has exactly the same neighbourhoods
+// as last time, so it must produce the same values again.
+//
+// Skipped tiles don't even need to be copied.  A tile is only skipped if it
+// didn't change last generation, which means that both grids already hold the
+// same values for it.
+//
+// This relies on every cell being a pure function of its neighbourhood, so it
+// can't be used for programs that use the global registers.
+
+// The width and height of a tile, in cells
+static const int TileSize = 32;
+
+struct tileGrid {
+  int16_t width;
+  int16_t height;
+  // The number of tiles in each direction
+  int tilesX;
+  int tilesY;
+  // Whether each tile changed in the last generation
+  uint8_t *changed;
+  // Whether each tile changed in the generation being computed
+  uint8_t *changing;
+};
+
+struct tileGrid *createTileGrid(int16_t width, int16_t height) {
+  struct tileGrid *t = calloc(1, sizeof(struct tileGrid));
+  t->width = width;
+  t->height = height;
+  t->tilesX = (width + TileSize - 1) / TileSize;
+  t->tilesY = (height + TileSize - 1) / TileSize;
+  t->changed = malloc(t->tilesX * t->tilesY);
+  t->changing = malloc(t->tilesX * t->tilesY);
+  // Nothing has been computed yet, so everything is dirty
+  memset(t->changed, 1, t->tilesX * t->tilesY);
+  return t;
+}
+
+void destroyTileGrid(struct tileGrid *t) {
+  if (t == NULL) {
+    return;
+  }
+  free(t->changed);
+  free(t->changing);
+  free(t);
+}
+
+// Returns whether the tile at (tx, ty) or any of its neighbours changed in
+// the last generation.
+static int isDirty(struct tileGrid *t, int tx, int ty) {
+  for (int x=tx-1 ; x<=tx+1 ; x++) {
+    if ((x < 0) || (x >= t->tilesX)) continue;
+    for (int y=ty-1 ; y<=ty+1 ; y++) {
+      if ((y < 0) || (y >= t->tilesY)) continue;
+      if (t->changed[x * t->tilesY + y]) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// The arguments for running one generation over a band of rows of tiles
+struct tileStep {
+  struct tileGrid *tiles;
+  int16_t *oldgrid;
+  int16_t *newgrid;
+  regionFn fn;
+  void *context;
+};
+
+static void runTileRows(void *context, int16_t rowBegin, int16_t rowEnd) {
+  struct tileStep *step = context;
+  struct tileGrid *t = step->tiles;
+  int height = t->height;
+  for (int tx=rowBegin ; tx<rowEnd ; tx++) {
+    for (int ty=0 ; ty<t->tilesY ; ty++) {
+      int tile = tx * t->tilesY + ty;
+      if (!isDirty(t, tx, ty)) {
+        t->changing[tile] = 0;
+        continue;
+      }
+      int16_t xBegin = tx * TileSize;
+      int16_t yBegin = ty * TileSize;
+      int16_t xEnd = (xBegin + TileSize < t->width) ? xBegin + TileSize : t->width;
+      int16_t yEnd = (yBegin + TileSize < height) ? yBegin + TileSize : height;
+      step->fn(step->context, xBegin, xEnd, yBegin, yEnd);
+      // Rows of a tile are contiguous, so compare them a row at a time.
+      int changed = 0;
+      for (int x=xBegin ; (x<xEnd) && !changed ; x++) {
+        int i = gridIndex(x, yBegin, height);
+        changed = memcmp(&step->oldgrid[i], &step->newgrid[i],
+                         (yEnd - yBegin) * sizeof(int16_t)) != 0;
+      }
+      t->changing[tile] = changed;
+    }
+  }
+}
+
+void runTiles(struct tileGrid *t, int16_t *oldgrid, int16_t *newgrid,
+              regionFn fn, void *context, struct threadPool *pool)
+{
+  struct tileStep step = { t, oldgrid, newgrid, fn, context };
+  runInBands(pool, t->tilesX, runTileRows, &step);
+  uint8_t *tmp = t->changed;
+  t->changed = t->changing;
+  t->changing = tmp;
+}